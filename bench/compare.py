@@ -0,0 +1,195 @@
+#!/usr/bin/env python3
+"""Compares obuild with GNU make and ninja on synthetic projects.
+
+The same generated graph is written as obuild.cfg, Makefile and
+build.ninja, with every command only touching its target, so that only
+the overhead of the build systems is compared.
+
+    python3 bench/compare.py --obuild ./obuild --sizes 1000,10000
+
+Every tool does a full build, a null build and a build after touching one
+source. Wall time, CPU time and peak RSS include the commands run; the
+number of processes spawned is counted in a separate run under strace,
+if it is installed. Results are written as JSON, to stdout unless -o is
+given, with a summary on stderr.
+"""
+
+import argparse
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import synth  # noqa: E402
+
+PHASES = ["full", "null", "touch_one"]
+
+
+def find_tool(name):
+    """An absolute path, as the builds run in the project directory."""
+    if os.sep in name:
+        name = os.path.abspath(name)
+    return shutil.which(name)
+
+
+def tool_cmds(args, jobs):
+    """The command line of each available tool, keyed by its name."""
+    cmds = {}
+    for name in ("obuild", "make", "ninja"):
+        path = find_tool(getattr(args, name))
+        if path:
+            cmds[name] = [path, "-j%d" % jobs]
+        else:
+            sys.stderr.write("%s not found, skipping\n" % name)
+    return cmds
+
+
+def count_spawns(cmd, cwd, env):
+    """The number of successful execve calls made by the command and
+    everything it ran, not counting the command itself; None without
+    strace
+    """
+    strace = shutil.which("strace")
+    if not strace:
+        return None
+    with tempfile.NamedTemporaryFile(mode="r", suffix=".strace") as out:
+        proc = subprocess.run(
+            [strace, "-f", "-qq", "-e", "trace=execve,execveat", "-e",
+             "signal=none", "-o", out.name] + cmd,
+            cwd=cwd, env=env, stdout=subprocess.DEVNULL,
+            stderr=subprocess.DEVNULL
+        )
+        if proc.returncode:
+            return None
+        n = 0
+        for line in out:
+            # failed lookups along PATH are not spawns
+            if "execve" in line and line.rstrip().endswith("= 0"):
+                n += 1
+        return max(0, n - 1)
+
+
+def run_phase(proj, root, cmd, phase, env, index):
+    if phase == "full":
+        synth.clean(root)
+    elif phase == "touch_one":
+        proj.touch_source(root, index)
+    return synth.run(cmd, root, env)
+
+
+def bench_size(args, size, env):
+    proj = synth.Project(
+        size, fan_in=args.fan_in, fan_out=args.fan_out, depth=args.depth,
+        headers=args.headers, depend_density=args.depend_density,
+        patterns=not args.no_patterns, use_glob=args.glob, seed=args.seed
+    )
+    root = os.path.join(args.dir, "c%d" % size)
+    shutil.rmtree(root, ignore_errors=True)
+    proj.create_files(root)
+    proj.write_obuild(root)
+    proj.write_make(root)
+    proj.write_ninja(root)
+    res = {
+        "rules": proj.nrules(), "edges": proj.nedges(),
+        "sources": len(proj.sources), "jobs": args.jobs, "tools": {},
+    }
+    for name, cmd in tool_cmds(args, args.jobs).items():
+        sys.stderr.write("  %s\n" % name)
+        tres = {}
+        for phase in PHASES:
+            samples = []
+            for i in range(args.repeat):
+                # a null build needs the full one before it
+                if phase == "null" and i == 0:
+                    run_phase(proj, root, cmd, "full", env, i)
+                samples.append(run_phase(proj, root, cmd, phase, env, i))
+            tres[phase] = synth.best(samples)
+        if not args.no_spawns:
+            for phase in PHASES:
+                if phase == "full":
+                    synth.clean(root)
+                elif phase == "touch_one":
+                    proj.touch_source(root, args.repeat)
+                tres[phase]["spawns"] = count_spawns(cmd, root, env)
+        res["tools"][name] = tres
+    if not args.keep:
+        shutil.rmtree(root, ignore_errors=True)
+    return res
+
+
+def summary(results):
+    lines = []
+    hdr = "%-8s %-8s %-10s %10s %10s %10s %8s" % (
+        "rules", "tool", "phase", "wall s", "cpu s", "rss kb", "spawns"
+    )
+    lines.append(hdr)
+    for r in results["results"]:
+        for name, tres in r["tools"].items():
+            for phase in PHASES:
+                p = tres[phase]
+                spawns = p.get("spawns")
+                lines.append("%-8d %-8s %-10s %10.3f %10.3f %10d %8s" % (
+                    r["rules"], name, phase, p["wall_s"],
+                    p["user_s"] + p["sys_s"], p["max_rss_kb"],
+                    "-" if spawns is None else str(spawns)
+                ))
+    return "\n".join(lines) + "\n"
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("--obuild", default="./obuild")
+    ap.add_argument("--make", default="make")
+    ap.add_argument("--ninja", default="ninja")
+    ap.add_argument("--sizes", type=synth.int_list, default=[1000, 10000],
+                    help="comma separated numbers of rules")
+    ap.add_argument("-j", "--jobs", type=int, default=os.cpu_count() or 1)
+    ap.add_argument("--fan-in", type=int, default=4)
+    ap.add_argument("--fan-out", type=int, default=2)
+    ap.add_argument("--depth", type=int, default=3)
+    ap.add_argument("--headers", type=int, default=50)
+    ap.add_argument("--depend-density", type=float, default=0.5)
+    ap.add_argument("--no-patterns", action="store_true")
+    ap.add_argument("--glob", action="store_true")
+    ap.add_argument("--repeat", type=int, default=3)
+    ap.add_argument("--seed", type=int, default=1)
+    ap.add_argument("--no-spawns", action="store_true",
+                    help="do not count spawned processes")
+    ap.add_argument("--dir", default="bench_work")
+    ap.add_argument("--keep", action="store_true")
+    ap.add_argument("-o", "--output", help="write the JSON here")
+    args = ap.parse_args()
+
+    # never hand the builds to a server, nor share a parent's job slots
+    env = dict(os.environ, OBUILD_SERVER="1")
+    for var in ("MAKEFLAGS", "MFLAGS", "MAKELEVEL"):
+        env.pop(var, None)
+    results = {
+        "cpus": os.cpu_count(),
+        "params": {
+            "fan_in": args.fan_in, "fan_out": args.fan_out,
+            "depth": args.depth, "headers": args.headers,
+            "depend_density": args.depend_density,
+            "patterns": not args.no_patterns, "glob": args.glob,
+            "repeat": args.repeat, "seed": args.seed, "jobs": args.jobs,
+        },
+        "results": [],
+    }
+    os.makedirs(args.dir, exist_ok=True)
+    for size in args.sizes:
+        sys.stderr.write("%d rules...\n" % size)
+        results["results"].append(bench_size(args, size, env))
+    data = json.dumps(results, indent=2) + "\n"
+    if args.output:
+        with open(args.output, "w") as fp:
+            fp.write(data)
+    else:
+        sys.stdout.write(data)
+    sys.stderr.write(summary(results))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,368 @@
+#!/usr/bin/env python3
+"""Generates synthetic projects and measures the overhead of obuild on them.
+
+Every rule body only touches its target, so the time measured is the time
+obuild itself takes: evaluating the build script, registering the rules,
+checking for null builds and scheduling the bodies.
+
+    python3 bench/synth.py --obuild ./obuild --sizes 1000,10000 -o out.json
+
+The projects can also be written as a Makefile and a build.ninja, which
+bench/compare.py uses to compare obuild with GNU make and ninja.
+
+A project is made of source files, one compile rule per source and layers
+of rules above them, each rule of a layer using --fan-in rules of the layer
+below and each rule of a layer being used by --fan-out rules of the layer
+above. The results are written as JSON, to stdout unless -o is given.
+"""
+
+import argparse
+import json
+import os
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+STATE_FILES = [
+    ".obuild_log", ".obuild_deps", ".obuild_graph", ".obuild_glob",
+    ".obuild_hashes", ".ninja_log", ".ninja_deps"
+]
+
+
+class Project:
+    """The rule graph of a synthetic project, independent of any tool."""
+
+    def __init__(self, rules, fan_in=4, fan_out=2, depth=3, headers=50,
+                 depend_density=0.5, patterns=True, use_glob=False, seed=1):
+        self.fan_in = max(1, fan_in)
+        self.fan_out = max(1, fan_out)
+        self.depth = max(0, depth)
+        self.patterns = patterns
+        self.use_glob = use_glob
+        rnd = random.Random(seed)
+        # layer widths shrink by fan_in / fan_out going up; the number of
+        # sources is picked so that all the rules add up to the size given
+        ratio = self.fan_out / self.fan_in
+        scale = sum(ratio ** k for k in range(self.depth + 1))
+        nsrc = max(1, round(rules / scale))
+        self.sources = ["src/s%d.c" % i for i in range(nsrc)]
+        self.headers = ["inc/h%d.h" % i for i in range(headers)]
+        # target -> list of dependencies, in the order of the layers
+        self.layers = []
+        self.layers.append(
+            [("src/s%d.o" % i, ["src/s%d.c" % i]) for i in range(nsrc)]
+        )
+        for k in range(1, self.depth + 1):
+            below = self.layers[-1]
+            width = max(1, round(len(below) * ratio))
+            if width == len(below) == 1:
+                break
+            layer = []
+            for i in range(width):
+                deps = []
+                for t in range(self.fan_in):
+                    dep = below[(i * self.fan_in + t) % len(below)][0]
+                    if dep not in deps:
+                        deps.append(dep)
+                layer.append(("out/l%d_%d" % (k, i), deps))
+            self.layers.append(layer)
+        # extra dependencies of the compile rules, like included headers
+        self.extra = {}
+        if self.headers:
+            for tgt, _ in self.layers[0]:
+                if rnd.random() < depend_density:
+                    self.extra[tgt] = rnd.sample(
+                        self.headers, min(3, len(self.headers))
+                    )
+        self.top = [tgt for tgt, _ in self.layers[-1]]
+
+    def nrules(self):
+        return sum(len(layer) for layer in self.layers)
+
+    def nedges(self):
+        return sum(len(deps) for layer in self.layers for _, deps in layer) \
+            + sum(len(v) for v in self.extra.values())
+
+    def create_files(self, root):
+        """Writes the sources and headers, along with output directories."""
+        for d in ("src", "inc", "out"):
+            os.makedirs(os.path.join(root, d), exist_ok=True)
+        for f in self.sources + self.headers:
+            with open(os.path.join(root, f), "w") as fp:
+                fp.write("%s\n" % f)
+
+    def touch_source(self, root, index=0):
+        """Modifies one source, for incremental builds."""
+        path = os.path.join(root, self.sources[index % len(self.sources)])
+        with open(path, "a") as fp:
+            fp.write("//\n")
+
+    def write_obuild(self, root):
+        out = []
+        out.append("// generated by bench/synth.py")
+        out.append("")
+        if self.use_glob:
+            out.append("SRCS = (glob src/*.c)")
+        else:
+            out.append("SRCS = [%s]" % " ".join(self.sources))
+        out.append("OBJS = (extreplace $SRCS .c .o)")
+        out.append("")
+        if self.patterns:
+            out.append("rule %.o %.c [")
+            out.append("    shell touch $target")
+            out.append("]")
+        else:
+            out.append("looplist s $SRCS [")
+            out.append("    rule (extreplace $s .c .o) $s [")
+            out.append("        shell touch $target")
+            out.append("    ]")
+            out.append("]")
+        for tgt in sorted(self.extra):
+            out.append("depend %s [%s]" % (tgt, " ".join(self.extra[tgt])))
+        for layer in self.layers[1:]:
+            for tgt, deps in layer:
+                out.append("rule %s [%s] [" % (tgt, " ".join(deps)))
+                out.append("    shell touch $target")
+                out.append("]")
+        if len(self.layers) == 1:
+            out.append("rule default $OBJS")
+        else:
+            out.append("rule default [%s]" % " ".join(self.top))
+        with open(os.path.join(root, "obuild.cfg"), "w") as fp:
+            fp.write("\n".join(out) + "\n")
+
+    def write_make(self, root):
+        """The same graph for GNU make, with a pattern rule if used."""
+        out = ["# generated by bench/synth.py", ""]
+        out.append("all: %s" % " ".join(self.top))
+        out.append("")
+        if self.patterns:
+            out.append("%.o: %.c")
+            out.append("\ttouch $@")
+        else:
+            for tgt, deps in self.layers[0]:
+                out.append("%s: %s" % (tgt, deps[0]))
+                out.append("\ttouch $@")
+        for tgt in sorted(self.extra):
+            out.append("%s: %s" % (tgt, " ".join(self.extra[tgt])))
+        for layer in self.layers[1:]:
+            for tgt, deps in layer:
+                out.append("%s: %s" % (tgt, " ".join(deps)))
+                out.append("\ttouch $@")
+        out.append("")
+        out.append(".PHONY: all")
+        with open(os.path.join(root, "Makefile"), "w") as fp:
+            fp.write("\n".join(out) + "\n")
+
+    def write_ninja(self, root):
+        """The same graph for ninja, which has no pattern rules."""
+        out = ["# generated by bench/synth.py", ""]
+        out.append("rule touch")
+        out.append("  command = touch $out")
+        out.append("")
+        for tgt, deps in self.layers[0]:
+            extra = self.extra.get(tgt)
+            out.append("build %s: touch %s%s" % (
+                tgt, deps[0], (" | " + " ".join(extra)) if extra else ""
+            ))
+        for layer in self.layers[1:]:
+            for tgt, deps in layer:
+                out.append("build %s: touch %s" % (tgt, " ".join(deps)))
+        out.append("build all: phony %s" % " ".join(self.top))
+        out.append("default all")
+        with open(os.path.join(root, "build.ninja"), "w") as fp:
+            fp.write("\n".join(out) + "\n")
+
+
+def clean(root, keep_state=False):
+    src = os.path.join(root, "src")
+    for f in os.listdir(src):
+        if f.endswith(".o"):
+            os.remove(os.path.join(src, f))
+    shutil.rmtree(os.path.join(root, "out"), ignore_errors=True)
+    os.makedirs(os.path.join(root, "out"))
+    if not keep_state:
+        for f in STATE_FILES:
+            try:
+                os.remove(os.path.join(root, f))
+            except FileNotFoundError:
+                pass
+
+
+# GNU time, for the peak RSS of the command alone; a child forked from
+# here carries the RSS of the interpreter into its own, which makes the
+# numbers from wait4 a floor for small commands
+GNU_TIME = shutil.which("time")
+
+
+def run(cmd, cwd, env=None):
+    """Runs a command, returning its wall time, CPU time and peak RSS,
+    all of which include the processes it ran.
+    """
+    with tempfile.TemporaryFile() as err, \
+            tempfile.NamedTemporaryFile(mode="r") as rss:
+        if GNU_TIME:
+            cmd = [GNU_TIME, "-f", "%M", "-o", rss.name] + cmd
+        start = time.perf_counter()
+        proc = subprocess.Popen(
+            cmd, cwd=cwd, env=env, stdout=subprocess.DEVNULL, stderr=err
+        )
+        _, status, ru = os.wait4(proc.pid, 0)
+        wall = time.perf_counter() - start
+        proc.returncode = os.waitstatus_to_exitcode(status)
+        if proc.returncode:
+            err.seek(0)
+            sys.stderr.write(err.read().decode(errors="replace"))
+            raise RuntimeError(
+                "%s failed with %d" % (cmd[0], proc.returncode)
+            )
+        maxrss = ru.ru_maxrss
+        if GNU_TIME:
+            maxrss = int(rss.read().split()[-1])
+    return {
+        "wall_s": round(wall, 6),
+        "user_s": round(ru.ru_utime, 6),
+        "sys_s": round(ru.ru_stime, 6),
+        "max_rss_kb": maxrss,
+    }
+
+
+def best(samples):
+    """The fastest of the repeated runs, along with all wall times."""
+    ret = dict(min(samples, key=lambda s: s["wall_s"]))
+    ret["runs_wall_s"] = [s["wall_s"] for s in samples]
+    return ret
+
+
+def trace_times(path, deffile):
+    """Config evaluation and graph registration times from a trace."""
+    with open(path) as fp:
+        events = json.load(fp)["traceEvents"]
+    config = graph = 0
+    for ev in events:
+        if ev.get("ph") != "X":
+            continue
+        # included files nest inside the build script itself
+        if ev["cat"] == "config" and ev["name"] == deffile:
+            config += ev["dur"]
+        elif ev["cat"] == "graph":
+            graph += ev["dur"]
+    return {"config_s": config / 1e6, "graph_s": graph / 1e6}
+
+
+def bench_size(args, size, env):
+    proj = Project(
+        size, fan_in=args.fan_in, fan_out=args.fan_out, depth=args.depth,
+        headers=args.headers, depend_density=args.depend_density,
+        patterns=not args.no_patterns, use_glob=args.glob, seed=args.seed
+    )
+    root = os.path.join(args.dir, "p%d" % size)
+    shutil.rmtree(root, ignore_errors=True)
+    proj.create_files(root)
+    proj.write_obuild(root)
+    obuild = os.path.abspath(args.obuild)
+    res = {
+        "rules": proj.nrules(), "edges": proj.nedges(),
+        "sources": len(proj.sources), "layers": len(proj.layers),
+    }
+
+    res["full"] = []
+    for jobs in args.jobs:
+        samples = []
+        for _ in range(args.repeat):
+            clean(root)
+            samples.append(run([obuild, "-j%d" % jobs], root, env))
+        res["full"].append(dict(best(samples), jobs=jobs))
+
+    # everything is built now; with the graph cached from the last run,
+    # whose job count is part of the cache key
+    jflag = "-j%d" % args.jobs[-1]
+    res["null"] = best([
+        run([obuild, jflag], root, env) for _ in range(args.repeat)
+    ])
+
+    # the build script is evaluated, then nothing is left to do
+    samples = []
+    trace = os.path.join(root, "trace.json")
+    for _ in range(args.repeat):
+        os.remove(os.path.join(root, ".obuild_graph"))
+        s = run([obuild, jflag, "-t", trace], root, env)
+        s.update(trace_times(trace, "obuild.cfg"))
+        samples.append(s)
+    res["null_eval"] = best(samples)
+
+    samples = []
+    for i in range(args.repeat):
+        proj.touch_source(root, i)
+        samples.append(run([obuild, jflag], root, env))
+    res["touch_one"] = best(samples)
+
+    if not args.keep:
+        shutil.rmtree(root, ignore_errors=True)
+    return res
+
+
+def int_list(s):
+    return [int(v) for v in s.split(",") if v]
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("--obuild", default="./obuild",
+                    help="the binary to measure (default: ./obuild)")
+    ap.add_argument("--sizes", type=int_list, default=[1000, 10000, 100000],
+                    help="comma separated numbers of rules")
+    ap.add_argument("--jobs", type=int_list, default=[1, 4, 8],
+                    help="comma separated -j values for full builds")
+    ap.add_argument("--fan-in", type=int, default=4)
+    ap.add_argument("--fan-out", type=int, default=2)
+    ap.add_argument("--depth", type=int, default=3,
+                    help="layers of rules above the compile rules")
+    ap.add_argument("--headers", type=int, default=50)
+    ap.add_argument("--depend-density", type=float, default=0.5,
+                    help="share of compile rules with depend lines")
+    ap.add_argument("--no-patterns", action="store_true",
+                    help="an explicit rule per source, not a pattern rule")
+    ap.add_argument("--glob", action="store_true",
+                    help="find the sources with glob")
+    ap.add_argument("--repeat", type=int, default=3)
+    ap.add_argument("--seed", type=int, default=1)
+    ap.add_argument("--dir", default="bench_work",
+                    help="where projects are generated")
+    ap.add_argument("--keep", action="store_true",
+                    help="keep the generated projects")
+    ap.add_argument("-o", "--output", help="write the JSON here")
+    args = ap.parse_args()
+
+    # never hand the builds to a server running somewhere
+    env = dict(os.environ, OBUILD_SERVER="1")
+    env.pop("MAKEFLAGS", None)
+    results = {
+        "obuild": os.path.abspath(args.obuild),
+        "cpus": os.cpu_count(),
+        "params": {
+            "fan_in": args.fan_in, "fan_out": args.fan_out,
+            "depth": args.depth, "headers": args.headers,
+            "depend_density": args.depend_density,
+            "patterns": not args.no_patterns, "glob": args.glob,
+            "repeat": args.repeat, "seed": args.seed,
+        },
+        "results": [],
+    }
+    os.makedirs(args.dir, exist_ok=True)
+    for size in args.sizes:
+        sys.stderr.write("%d rules...\n" % size)
+        results["results"].append(bench_size(args, size, env))
+    data = json.dumps(results, indent=2) + "\n"
+    if args.output:
+        with open(args.output, "w") as fp:
+            fp.write(data)
+    else:
+        sys.stdout.write(data)
+
+
+if __name__ == "__main__":
+    main()
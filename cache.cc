@@ -0,0 +1,241 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "cache.hh"
+#include "filehash.hh"
+
+namespace obuild {
+
+artifact_cache::artifact_cache(std::string dir): p_dir{std::move(dir)} {}
+
+static std::string to_hex(std::uint64_t v) {
+    char buf[17];
+    std::snprintf(
+        buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(v)
+    );
+    return buf;
+}
+
+static bool make_dirs(std::string const &path) {
+    for (std::size_t i = 1; i <= path.size(); ++i) {
+        if ((i != path.size()) && (path[i] != '/')) {
+            continue;
+        }
+        std::string sub{path, 0, i};
+        if (mkdir(sub.data(), 0777) && (errno != EEXIST)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* copies through a temporary file, so that readers never see a partial
+ * file; the permissions are kept (think linked executables)
+ */
+static bool copy_file(std::string const &src, std::string const &dst) {
+    file_map f;
+    struct stat st;
+    if (!f.open(src) || stat(src.data(), &st)) {
+        return false;
+    }
+    auto tmp = dst + ".obuild-tmp";
+    int fd = open(tmp.data(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        return false;
+    }
+    auto data = f.data();
+    std::size_t wr = 0;
+    while (wr < data.size()) {
+        auto w = write(fd, data.data() + wr, data.size() - wr);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            unlink(tmp.data());
+            return false;
+        }
+        wr += std::size_t(w);
+    }
+    fchmod(fd, st.st_mode & 07777);
+    if (close(fd) || rename(tmp.data(), dst.data())) {
+        unlink(tmp.data());
+        return false;
+    }
+    return true;
+}
+
+std::uint64_t artifact_cache::content_hash(std::string const &path) {
+    auto fi = stat_file(path);
+    if (!fi.exists()) {
+        return 0;
+    }
+    {
+        std::lock_guard<std::mutex> l{p_lock};
+        auto it = p_hashes.find(path);
+        if ((it != p_hashes.end()) && (it->second.first == fi)) {
+            return it->second.second;
+        }
+    }
+    auto h = hash_file(path);
+    if (!h) {
+        return 0;
+    }
+    std::lock_guard<std::mutex> l{p_lock};
+    p_hashes[path] = std::make_pair(fi, h);
+    return h;
+}
+
+std::uint64_t artifact_cache::tool_hash(std::string const &tool) {
+    std::lock_guard<std::mutex> l{p_lock};
+    auto it = p_tools.find(tool);
+    if (it != p_tools.end()) {
+        return it->second;
+    }
+    /* resolve like the spawn would; a tool that is not found only
+     * contributes its name
+     */
+    std::string path = tool;
+    file_info fi;
+    if (tool.find('/') != tool.npos) {
+        fi = stat_file(tool);
+    } else if (char const *penv = std::getenv("PATH"); penv) {
+        std::string_view pv{penv};
+        while (!fi.exists() && !pv.empty()) {
+            auto sep = pv.find(':');
+            std::string dir{pv.substr(0, sep)};
+            pv = (sep == pv.npos) ? std::string_view{} : pv.substr(sep + 1);
+            path = (dir.empty() ? std::string{"."} : dir) + '/' + tool;
+            fi = stat_file(path);
+        }
+    }
+    auto h = hash_string(path);
+    h = hash_string(to_hex(std::uint64_t(fi.mtime)), h);
+    h = hash_string(to_hex(std::uint64_t(fi.size)), h);
+    p_tools.emplace(tool, h);
+    return h;
+}
+
+std::string artifact_cache::entry_dir(std::uint64_t key) const {
+    auto hex = to_hex(key);
+    return p_dir + '/' + hex.substr(0, 2) + '/' + hex;
+}
+
+std::uint64_t artifact_cache::key(build_job const &job) {
+    if (!job.cacheable || job.tools.empty()) {
+        return 0;
+    }
+    auto h = hash_string("obuild cache 2");
+    h = hash_string(job.target(), h);
+    h = hash_string(to_hex(job.entry.cmd_hash), h);
+    for (auto &in: job.entry.inputs) {
+        auto ch = content_hash(in.first);
+        if (!ch) {
+            return 0;
+        }
+        h = hash_string(in.first, h);
+        h = hash_string(to_hex(ch), h);
+    }
+    for (auto &tool: job.tools) {
+        h = hash_string(to_hex(tool_hash(tool)), h);
+    }
+    return h ? h : 1;
+}
+
+/* each line of a manifest is a result and the dependencies it has:
+ * result, then pairs of path and content hash, all tab separated
+ */
+bool artifact_cache::restore(
+    std::uint64_t key, std::string const &target, deps_log::dep_list &deps
+) {
+    auto dir = entry_dir(key);
+    std::string data;
+    if (!read_file(dir + "/manifest", data)) {
+        ++p_misses;
+        return false;
+    }
+    std::string_view sv = data;
+    std::vector<std::string_view> lines;
+    for (auto nl = sv.find('\n'); nl != sv.npos; nl = sv.find('\n')) {
+        lines.push_back(sv.substr(0, nl));
+        sv = sv.substr(nl + 1);
+    }
+    /* newest entries first */
+    for (auto lit = lines.rbegin(); lit != lines.rend(); ++lit) {
+        std::vector<std::string_view> fields;
+        for (auto line = *lit;;) {
+            auto tab = line.find('\t');
+            fields.push_back(line.substr(0, tab));
+            if (tab == line.npos) {
+                break;
+            }
+            line = line.substr(tab + 1);
+        }
+        if (!(fields.size() % 2)) {
+            continue;
+        }
+        bool match = true;
+        deps.clear();
+        for (std::size_t i = 1; match && (i < fields.size()); i += 2) {
+            std::string path{fields[i]};
+            match = (to_hex(content_hash(path)) == fields[i + 1]);
+            deps.emplace_back(std::move(path), file_info{});
+        }
+        if (match && copy_file(dir + '/' + std::string{fields[0]}, target)) {
+            ++p_hits;
+            return true;
+        }
+    }
+    deps.clear();
+    ++p_misses;
+    return false;
+}
+
+void artifact_cache::store(
+    std::uint64_t key, std::string const &target,
+    deps_log::dep_list const &deps
+) {
+    auto dir = entry_dir(key);
+    std::string line;
+    auto h = key;
+    for (auto &dep: deps) {
+        auto ch = to_hex(content_hash(dep.first));
+        h = hash_string(dep.first, h);
+        h = hash_string(ch, h);
+        line += '\t';
+        line += dep.first;
+        line += '\t';
+        line += ch;
+    }
+    auto result = to_hex(h);
+    line = result + line + '\n';
+    std::string data;
+    if (read_file(dir + "/manifest", data) && (
+        (data.compare(0, line.size(), line) == 0) ||
+        (data.find('\n' + line) != data.npos)
+    )) {
+        return;
+    }
+    if (!make_dirs(dir) || !copy_file(target, dir + '/' + result)) {
+        return;
+    }
+    /* a single small appending write, so concurrent builds are fine */
+    int fd = open(
+        (dir + "/manifest").data(), O_WRONLY | O_CREAT | O_APPEND, 0666
+    );
+    if (fd < 0) {
+        return;
+    }
+    if (write(fd, line.data(), line.size()) != ssize_t(line.size())) {
+        /* nothing to do, the entry will just never be found */
+    }
+    close(fd);
+}
+
+} /* namespace obuild */
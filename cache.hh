@@ -0,0 +1,61 @@
+#ifndef OBUILD_CACHE_HH
+#define OBUILD_CACHE_HH
+
+#include <cstdint>
+#include <string>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+
+#include "state.hh"
+
+namespace obuild {
+
+/* a local content addressed store of rule outputs, which can be shared
+ * between build directories; an entry is keyed on the commands, the
+ * contents of the inputs and the identity of the tools, and then on
+ * the contents of the dependencies discovered when it was built
+ */
+struct artifact_cache {
+    artifact_cache(std::string dir);
+
+    /* 0 if the job cannot be cached */
+    std::uint64_t key(build_job const &job);
+
+    /* on a hit, the output is restored and deps are the dependencies it
+     * was built with (without stat data)
+     */
+    bool restore(
+        std::uint64_t key, std::string const &target, deps_log::dep_list &deps
+    );
+
+    /* thread safe, called once the job is done */
+    void store(
+        std::uint64_t key, std::string const &target,
+        deps_log::dep_list const &deps
+    );
+
+    std::size_t hits() const {
+        return p_hits;
+    }
+
+    std::size_t misses() const {
+        return p_misses;
+    }
+
+private:
+    std::uint64_t content_hash(std::string const &path);
+    std::uint64_t tool_hash(std::string const &tool);
+    std::string entry_dir(std::uint64_t key) const;
+
+    std::string p_dir;
+    std::mutex p_lock;
+    std::unordered_map<std::string, std::pair<file_info, std::uint64_t>> p_hashes;
+    std::unordered_map<std::string, std::uint64_t> p_tools;
+    std::atomic<std::size_t> p_hits{0};
+    std::atomic<std::size_t> p_misses{0};
+};
+
+} /* namespace obuild */
+
+#endif
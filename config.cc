@@ -0,0 +1,305 @@
+#include <cstdio>
+#include <cstdlib>
+
+#include "state.hh"
+#include "filehash.hh"
+#include "glob.hh"
+
+namespace obuild {
+
+static constexpr char const *CACHE_HEADER = "# obuild graph 5\n";
+
+void config_cache::add_file(std::string const &path, std::string_view data) {
+    p_files[path] = file{stat_file(path), hash_data(data)};
+}
+
+void config_cache::add_file(
+    std::string const &path, file_info const &info, std::uint64_t hash
+) {
+    p_files[path] = file{info, hash};
+}
+
+void config_cache::add_env(
+    std::string const &name, std::optional<std::string> const &val
+) {
+    p_env.emplace(name, val);
+}
+
+void config_cache::add_dir(std::string const &path, file_info const &info) {
+    p_dirs.emplace(path, info);
+}
+
+void config_cache::add_output(std::string_view line) {
+    if (p_evaluating) {
+        p_output.emplace_back(line);
+    }
+}
+
+static bool valid_field(std::string_view s) {
+    return s.find_first_of("\t\n") == s.npos;
+}
+
+static bool read_line(std::string_view &data, std::string_view &line) {
+    if (data.empty()) {
+        return false;
+    }
+    auto nl = data.find('\n');
+    if (nl == data.npos) {
+        /* a partial write */
+        return false;
+    }
+    line = data.substr(0, nl);
+    data = data.substr(nl + 1);
+    return true;
+}
+
+static std::vector<std::string_view> split_fields(std::string_view line) {
+    std::vector<std::string_view> ret;
+    for (;;) {
+        auto tab = line.find('\t');
+        ret.push_back(line.substr(0, tab));
+        if (tab == line.npos) {
+            break;
+        }
+        line = line.substr(tab + 1);
+    }
+    return ret;
+}
+
+static std::int64_t to_int(std::string_view s, int base = 10) {
+    std::string buf{s};
+    return std::int64_t(std::strtoull(buf.data(), nullptr, base));
+}
+
+/* the stat info of directories is written with a fixed width, so that it
+ * can be refreshed in place; replacing the file would change the stat
+ * info of the build directory all over again
+ */
+static constexpr int DIR_STAT_WIDTH = 20;
+
+static void dir_stat(std::string &buf, file_info const &fi) {
+    char nbuf[64];
+    std::snprintf(
+        nbuf, sizeof(nbuf), "\t%0*lld\t%0*lld", DIR_STAT_WIDTH,
+        static_cast<long long>(fi.mtime), DIR_STAT_WIDTH,
+        static_cast<long long>(fi.size)
+    );
+    buf += nbuf;
+}
+
+/* a torn write only makes the directory get read again */
+static void dir_refresh(
+    std::string const &path,
+    std::vector<std::pair<std::size_t, file_info>> const &dirs
+) {
+    std::FILE *f = std::fopen(path.data(), "r+b");
+    if (!f) {
+        return;
+    }
+    std::string buf;
+    for (auto &d: dirs) {
+        buf.clear();
+        dir_stat(buf, d.second);
+        if (std::fseek(f, long(d.first), SEEK_SET)) {
+            break;
+        }
+        std::fwrite(buf.data(), 1, buf.size(), f);
+    }
+    std::fclose(f);
+}
+
+bool config_cache::load(
+    std::string const &path, std::uint64_t options, rule_graph &graph,
+    body_hash const &body, std::vector<std::string> &output
+) {
+    std::string buf;
+    if (!read_file(path, buf)) {
+        return false;
+    }
+    std::string_view data = buf, line;
+    if (
+        !read_line(data, line) || ((std::string{line} + '\n') != CACHE_HEADER)
+    ) {
+        return false;
+    }
+    /* everything is validated before the graph is touched */
+    std::vector<std::vector<std::string_view>> rules, order, groups;
+    std::vector<std::string> out;
+    /* directories whose listing is the same, but not their stat info */
+    std::vector<std::pair<std::size_t, file_info>> refreshed;
+    bool opts = false;
+    while (read_line(data, line)) {
+        auto fs = split_fields(line);
+        auto type = fs[0];
+        if ((type == "O") && (fs.size() == 2)) {
+            if (std::uint64_t(to_int(fs[1], 16)) != options) {
+                return false;
+            }
+            opts = true;
+        } else if ((type == "F") && (fs.size() == 5)) {
+            std::string fname{fs[1]};
+            file_info fi{to_int(fs[2]), to_int(fs[3])};
+            if (stat_file(fname) == fi) {
+                continue;
+            }
+            /* touched but not necessarily changed */
+            if (hash_file(fname) != std::uint64_t(to_int(fs[4], 16))) {
+                return false;
+            }
+        } else if ((type == "E") && (fs.size() == 3)) {
+            std::string name{fs[1]};
+            char const *val = std::getenv(name.data());
+            if (fs[2].empty() ? !!val : (!val || (fs[2].substr(1) != val))) {
+                return false;
+            }
+        } else if ((type == "D") && (fs.size() == 5)) {
+            file_info fi{
+                to_int(fs[2]), to_int(fs[3]),
+                std::uint64_t(to_int(fs[4], 16))
+            };
+            auto old = fi;
+            /* saving the state of the build touches the build directory */
+            if (!dir_unchanged(std::string{fs[1]}, fi)) {
+                return false;
+            }
+            /* the separator before the stat info, as dir_stat writes it */
+            auto width = std::size_t(DIR_STAT_WIDTH);
+            if (
+                !(fi == old) && (fs[2].size() == width) &&
+                (fs[3].size() == width)
+            ) {
+                refreshed.emplace_back(fs[2].data() - buf.data() - 1, fi);
+            }
+        } else if ((type == "P") && (fs.size() == 2)) {
+            out.emplace_back(fs[1]);
+        } else if ((type == "R") && (fs.size() >= 5)) {
+            rules.push_back(std::move(fs));
+        } else if ((type == "B") && (fs.size() >= 3)) {
+            order.push_back(std::move(fs));
+        } else if ((type == "G") && (fs.size() >= 3)) {
+            groups.push_back(std::move(fs));
+        } else {
+            return false;
+        }
+    }
+    if (!opts || !data.empty()) {
+        return false;
+    }
+    if (!refreshed.empty()) {
+        dir_refresh(path, refreshed);
+    }
+    for (auto &r: rules) {
+        graph.add(
+            r[4], std::vector<std::string>(r.begin() + 5, r.end()),
+            (r[2] == "1") ? body : body_hash{}, r[1] == "1", r[3] == "1"
+        );
+    }
+    for (auto &o: order) {
+        graph.add_order(
+            o[1], std::vector<std::string>(o.begin() + 2, o.end())
+        );
+    }
+    for (auto &g: groups) {
+        graph.add_group(
+            g[1], std::vector<std::string>(g.begin() + 2, g.end())
+        );
+    }
+    output = std::move(out);
+    return true;
+}
+
+bool config_cache::save(
+    std::string const &path, std::uint64_t options, rule_graph const &graph
+) {
+    bool valid = p_cacheable;
+    std::string buf{CACHE_HEADER};
+    auto field = [&buf, &valid](std::string_view s) {
+        valid = valid && valid_field(s);
+        buf += '\t';
+        buf += s;
+    };
+    auto num = [&buf](char const *fmt, auto v) {
+        char nbuf[32];
+        std::snprintf(nbuf, sizeof(nbuf), fmt, v);
+        buf += '\t';
+        buf += nbuf;
+    };
+    buf += 'O';
+    num("%llx", static_cast<unsigned long long>(options));
+    buf += '\n';
+    for (auto &p: p_files) {
+        buf += 'F';
+        field(p.first);
+        num("%lld", static_cast<long long>(p.second.info.mtime));
+        num("%lld", static_cast<long long>(p.second.info.size));
+        num("%llx", static_cast<unsigned long long>(p.second.hash));
+        buf += '\n';
+    }
+    for (auto &p: p_env) {
+        buf += 'E';
+        field(p.first);
+        /* distinguish unset from empty */
+        field(p.second ? ("=" + *p.second) : std::string{});
+        buf += '\n';
+    }
+    for (auto &p: p_dirs) {
+        buf += 'D';
+        field(p.first);
+        dir_stat(buf, p.second);
+        num("%llx", static_cast<unsigned long long>(p.second.hash));
+        buf += '\n';
+    }
+    for (auto &line: p_output) {
+        buf += 'P';
+        field(line);
+        buf += '\n';
+    }
+    graph.each([&buf, &field](
+        std::string const &target, std::vector<std::string> const &deps,
+        bool body, bool action, bool restat
+    ) {
+        buf += 'R';
+        field(action ? "1" : "0");
+        field(body ? "1" : "0");
+        field(restat ? "1" : "0");
+        field(target);
+        for (auto &dep: deps) {
+            field(dep);
+        }
+        buf += '\n';
+    });
+    graph.each_order([&buf, &field](
+        std::string const &target, std::vector<std::string> const &deps
+    ) {
+        buf += 'B';
+        field(target);
+        for (auto &dep: deps) {
+            field(dep);
+        }
+        buf += '\n';
+    });
+    graph.each_group([&buf, &field](
+        std::string const &primary, std::vector<std::string> const &others
+    ) {
+        buf += 'G';
+        field(primary);
+        for (auto &out: others) {
+            field(out);
+        }
+        buf += '\n';
+    });
+    if (!valid) {
+        std::remove(path.data());
+        return false;
+    }
+    auto tmp = path + ".tmp";
+    std::FILE *f = std::fopen(tmp.data(), "wb");
+    if (!f) {
+        return false;
+    }
+    bool ret = (std::fwrite(buf.data(), 1, buf.size(), f) == buf.size());
+    ret = !std::fclose(f) && ret;
+    return ret && !std::rename(tmp.data(), path.data());
+}
+
+} /* namespace obuild */
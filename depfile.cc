@@ -0,0 +1,89 @@
+#include "depfile.hh"
+#include "state.hh"
+
+namespace obuild {
+
+void parse_depfile(std::string_view data, std::vector<std::string> &deps) {
+    std::string tok;
+    bool targets = true;
+    auto flush = [&tok, &targets, &deps]() {
+        if (!tok.empty() && !targets) {
+            deps.push_back(tok);
+        }
+        tok.clear();
+    };
+    std::size_t n = data.size();
+    for (std::size_t i = 0; i < n;) {
+        /* copy the plain part of a name at once */
+        auto e = data.find_first_of(" \t\r\n\\$:", i);
+        if (e == data.npos) {
+            e = n;
+        }
+        tok.append(data, i, e - i);
+        if ((i = e) == n) {
+            break;
+        }
+        char c = data[i++];
+        switch (c) {
+            case ' ':
+            case '\t':
+            case '\r':
+                flush();
+                break;
+            case '\n':
+                flush();
+                targets = true;
+                break;
+            case '\\':
+                /* line continuations and escaped spaces; any other
+                 * backslash is literal (think windows paths)
+                 */
+                if ((i < n) && (data[i] == '\n')) {
+                    ++i;
+                    flush();
+                } else if (
+                    ((i + 1) < n) && (data[i] == '\r') && (data[i + 1] == '\n')
+                ) {
+                    i += 2;
+                    flush();
+                } else if ((i < n) && ((data[i] == ' ') || (data[i] == '#'))) {
+                    tok += data[i++];
+                } else {
+                    tok += '\\';
+                }
+                break;
+            case '$':
+                if ((i < n) && (data[i] == '$')) {
+                    ++i;
+                }
+                tok += '$';
+                break;
+            case ':':
+                /* only a colon followed by whitespace ends the targets */
+                if (targets && (
+                    (i == n) || (data[i] == ' ') || (data[i] == '\t') ||
+                    (data[i] == '\r') || (data[i] == '\n')
+                )) {
+                    tok.clear();
+                    targets = false;
+                } else {
+                    tok += ':';
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    flush();
+}
+
+bool read_depfile(std::string const &path, std::vector<std::string> &deps) {
+    std::string data;
+    if (!read_file(path, data)) {
+        return false;
+    }
+    parse_depfile(data, deps);
+    return true;
+}
+
+} /* namespace obuild */
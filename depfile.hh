@@ -0,0 +1,20 @@
+#ifndef OBUILD_DEPFILE_HH
+#define OBUILD_DEPFILE_HH
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace obuild {
+
+/* collects the prerequisites of all rules in a make style depfile, as
+ * written by gcc/clang -MD; targets are ignored
+ */
+void parse_depfile(std::string_view data, std::vector<std::string> &deps);
+
+/* false if the file could not be read */
+bool read_depfile(std::string const &path, std::vector<std::string> &deps);
+
+} /* namespace obuild */
+
+#endif
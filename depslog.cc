@@ -0,0 +1,258 @@
+#include <cstring>
+
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "state.hh"
+
+namespace obuild {
+
+/* the header is padded to keep the records 4-byte aligned */
+static constexpr char LOG_HEADER[16] = "# obuild deps 2";
+
+/* the high bit of a record's size word marks a dependency record */
+static constexpr std::uint32_t DEPS_RECORD = 1U << 31;
+
+/* rewrite the log once it is mostly made of stale records */
+static constexpr std::size_t LOG_COMPACT_MIN = 1000;
+static constexpr std::size_t LOG_COMPACT_RATIO = 3;
+
+/* id, padding, mtime, size, content hash */
+static constexpr std::size_t DEP_SIZE = 32;
+
+deps_log::~deps_log() {
+    if (p_file) {
+        std::fclose(p_file);
+    }
+}
+
+template<typename T>
+static T read_val(char const *p) {
+    T ret;
+    std::memcpy(&ret, p, sizeof(T));
+    return ret;
+}
+
+bool deps_log::load() {
+    std::string data;
+    if (
+        !read_file(p_path, data) || (data.size() < sizeof(LOG_HEADER)) ||
+        std::memcmp(data.data(), LOG_HEADER, sizeof(LOG_HEADER))
+    ) {
+        return false;
+    }
+    std::size_t off = sizeof(LOG_HEADER);
+    while ((off + 4) <= data.size()) {
+        auto word = read_val<std::uint32_t>(&data[off]);
+        std::size_t size = word & ~DEPS_RECORD;
+        if ((size % 4) || ((off + 4 + size) > data.size())) {
+            /* a partial write from an interrupted build */
+            break;
+        }
+        char const *rec = &data[off + 4];
+        if (!(word & DEPS_RECORD)) {
+            std::size_t len = size;
+            while (len && !rec[len - 1]) {
+                --len;
+            }
+            if (!len) {
+                break;
+            }
+            p_paths.emplace_back(rec, len);
+            p_ids.emplace(p_paths.back(), std::uint32_t(p_paths.size() - 1));
+            p_deps.emplace_back();
+            off += 4 + size;
+            continue;
+        }
+        if ((size < 8) || ((size - 8) % DEP_SIZE)) {
+            break;
+        }
+        auto id = read_val<std::uint32_t>(rec);
+        auto ndeps = read_val<std::uint32_t>(rec + 4);
+        if ((id >= p_paths.size()) || (ndeps != ((size - 8) / DEP_SIZE))) {
+            break;
+        }
+        std::vector<dep> deps;
+        deps.reserve(ndeps);
+        bool valid = true;
+        for (char const *dp = rec + 8; dp != (rec + size); dp += DEP_SIZE) {
+            dep d;
+            d.id = read_val<std::uint32_t>(dp);
+            d.info.mtime = read_val<std::int64_t>(dp + 8);
+            d.info.size = read_val<std::int64_t>(dp + 16);
+            d.info.hash = read_val<std::uint64_t>(dp + 24);
+            if (d.id >= p_paths.size()) {
+                valid = false;
+                break;
+            }
+            deps.push_back(d);
+        }
+        if (!valid) {
+            break;
+        }
+        if (p_deps[id].empty()) {
+            ++p_live;
+        }
+        p_deps[id] = std::move(deps);
+        ++p_records;
+        off += 4 + size;
+    }
+    if (off != data.size()) {
+        /* drop the garbage so that new records can be appended */
+        if (truncate(p_path.data(), off_t(off))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void deps_log::write_path(std::string const &path) {
+    std::uint32_t size = std::uint32_t((path.size() + 4) & ~std::size_t(3));
+    char pad[4] = {0, 0, 0, 0};
+    std::fwrite(&size, 4, 1, p_file);
+    std::fwrite(path.data(), 1, path.size(), p_file);
+    std::fwrite(pad, 1, size - path.size(), p_file);
+}
+
+void deps_log::write_deps(std::uint32_t id, std::vector<dep> const &deps) {
+    std::uint32_t word = std::uint32_t(8 + deps.size() * DEP_SIZE);
+    word |= DEPS_RECORD;
+    std::uint32_t ndeps = std::uint32_t(deps.size()), pad = 0;
+    std::fwrite(&word, 4, 1, p_file);
+    std::fwrite(&id, 4, 1, p_file);
+    std::fwrite(&ndeps, 4, 1, p_file);
+    for (auto &d: deps) {
+        std::fwrite(&d.id, 4, 1, p_file);
+        std::fwrite(&pad, 4, 1, p_file);
+        std::fwrite(&d.info.mtime, 8, 1, p_file);
+        std::fwrite(&d.info.size, 8, 1, p_file);
+        std::fwrite(&d.info.hash, 8, 1, p_file);
+    }
+}
+
+bool deps_log::write_all() {
+    /* renumber, dropping the paths nothing refers to anymore */
+    std::vector<std::uint32_t> ids(p_paths.size(), ~std::uint32_t(0));
+    std::uint32_t nid = 0;
+    for (std::size_t i = 0; i < p_deps.size(); ++i) {
+        if (p_deps[i].empty()) {
+            continue;
+        }
+        if (ids[i] == ~std::uint32_t(0)) {
+            ids[i] = nid++;
+        }
+        for (auto &d: p_deps[i]) {
+            if (ids[d.id] == ~std::uint32_t(0)) {
+                ids[d.id] = nid++;
+            }
+        }
+    }
+    std::deque<std::string> paths;
+    std::vector<std::vector<dep>> deps(nid);
+    paths.resize(nid);
+    for (std::size_t i = 0; i < p_paths.size(); ++i) {
+        if (ids[i] != ~std::uint32_t(0)) {
+            paths[ids[i]] = std::move(p_paths[i]);
+        }
+    }
+    for (std::size_t i = 0; i < p_deps.size(); ++i) {
+        if (p_deps[i].empty()) {
+            continue;
+        }
+        for (auto &d: p_deps[i]) {
+            d.id = ids[d.id];
+        }
+        deps[ids[i]] = std::move(p_deps[i]);
+    }
+    p_paths = std::move(paths);
+    p_deps = std::move(deps);
+    p_ids.clear();
+    for (std::size_t i = 0; i < p_paths.size(); ++i) {
+        p_ids.emplace(p_paths[i], std::uint32_t(i));
+    }
+
+    auto tmp = p_path + ".tmp";
+    p_file = std::fopen(tmp.data(), "wb");
+    if (!p_file) {
+        return false;
+    }
+    std::fwrite(LOG_HEADER, 1, sizeof(LOG_HEADER), p_file);
+    for (auto &path: p_paths) {
+        write_path(path);
+    }
+    p_records = p_live = 0;
+    for (std::size_t i = 0; i < p_deps.size(); ++i) {
+        if (!p_deps[i].empty()) {
+            write_deps(std::uint32_t(i), p_deps[i]);
+            ++p_records;
+            ++p_live;
+        }
+    }
+    bool ret = !std::fclose(p_file) && !std::rename(tmp.data(), p_path.data());
+    p_file = nullptr;
+    return ret;
+}
+
+bool deps_log::open(std::string path) {
+    p_path = std::move(path);
+    if (!load() || (
+        (p_records > LOG_COMPACT_MIN) &&
+        (p_records > (p_live * LOG_COMPACT_RATIO))
+    )) {
+        if (!write_all()) {
+            return false;
+        }
+    }
+    p_file = std::fopen(p_path.data(), "ab");
+    return !!p_file;
+}
+
+bool deps_log::find(std::string const &target, dep_list &deps) const {
+    std::lock_guard<std::mutex> l{p_lock};
+    deps.clear();
+    auto it = p_ids.find(target);
+    if ((it == p_ids.end()) || p_deps[it->second].empty()) {
+        return false;
+    }
+    for (auto &d: p_deps[it->second]) {
+        deps.emplace_back(p_paths[d.id], d.info);
+    }
+    return true;
+}
+
+std::uint32_t deps_log::intern(std::string const &path) {
+    auto it = p_ids.find(path);
+    if (it != p_ids.end()) {
+        return it->second;
+    }
+    auto id = std::uint32_t(p_paths.size());
+    p_paths.push_back(path);
+    p_ids.emplace(p_paths.back(), id);
+    p_deps.emplace_back();
+    if (p_file) {
+        write_path(path);
+    }
+    return id;
+}
+
+void deps_log::record(std::string const &target, dep_list const &deps) {
+    std::lock_guard<std::mutex> l{p_lock};
+    auto id = intern(target);
+    std::vector<dep> ndeps;
+    ndeps.reserve(deps.size());
+    for (auto &d: deps) {
+        ndeps.push_back(dep{intern(d.first), d.second});
+    }
+    if (p_deps[id].empty() != ndeps.empty()) {
+        p_live += ndeps.empty() ? -1 : 1;
+    }
+    if (p_file) {
+        write_deps(id, ndeps);
+        /* keep the log consistent even if we get killed */
+        std::fflush(p_file);
+    }
+    ++p_records;
+    p_deps[id] = std::move(ndeps);
+}
+
+} /* namespace obuild */
@@ -0,0 +1,163 @@
+#include <cstring>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+#include "filehash.hh"
+#include "state.hh"
+
+namespace obuild {
+
+static constexpr std::uint64_t PRIME1 = 11400714785074694791ULL;
+static constexpr std::uint64_t PRIME2 = 14029467366897019727ULL;
+static constexpr std::uint64_t PRIME3 = 1609587929392839161ULL;
+static constexpr std::uint64_t PRIME4 = 9650029242287828579ULL;
+static constexpr std::uint64_t PRIME5 = 2870177450012600261ULL;
+
+/* files up to this size are hashed in one go, bigger ones are hashed
+ * chunk by chunk and the chunk hashes are hashed once more
+ */
+static constexpr std::size_t CHUNK_SIZE = 1 << 20;
+/* spawning threads is not worth it for fewer chunks */
+static constexpr std::size_t PARALLEL_CHUNKS = 8;
+
+/* helper threads running for all hash_file calls together, which may
+ * come from several build tasks at once
+ */
+static std::atomic<int> helpers_running{0};
+
+/* up to the given number of helpers, so that there are never more than
+ * max running in total; may be none
+ */
+static int helpers_reserve(int n, int max) {
+    int cur = helpers_running.load();
+    for (;;) {
+        int k = std::min(n, max - cur);
+        if (k <= 0) {
+            return 0;
+        }
+        if (helpers_running.compare_exchange_weak(cur, cur + k)) {
+            return k;
+        }
+    }
+}
+
+static inline std::uint64_t rotl(std::uint64_t v, int n) {
+    return (v << n) | (v >> (64 - n));
+}
+
+/* unaligned little endian loads, which compile to plain moves */
+static inline std::uint64_t read64(unsigned char const *p) {
+    std::uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline std::uint32_t read32(unsigned char const *p) {
+    std::uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline std::uint64_t round(std::uint64_t acc, std::uint64_t in) {
+    acc += in * PRIME2;
+    return rotl(acc, 31) * PRIME1;
+}
+
+static inline std::uint64_t merge(std::uint64_t acc, std::uint64_t v) {
+    acc ^= round(0, v);
+    return acc * PRIME1 + PRIME4;
+}
+
+std::uint64_t hash_data(std::string_view data, std::uint64_t seed) {
+    auto p = reinterpret_cast<unsigned char const *>(data.data());
+    auto end = p + data.size();
+    std::uint64_t h;
+    if (data.size() >= 32) {
+        /* four independent lanes keep the multipliers busy */
+        std::uint64_t v1 = seed + PRIME1 + PRIME2;
+        std::uint64_t v2 = seed + PRIME2;
+        std::uint64_t v3 = seed;
+        std::uint64_t v4 = seed - PRIME1;
+        auto last = end - 32;
+        do {
+            v1 = round(v1, read64(p));
+            v2 = round(v2, read64(p + 8));
+            v3 = round(v3, read64(p + 16));
+            v4 = round(v4, read64(p + 24));
+            p += 32;
+        } while (p <= last);
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = merge(h, v1);
+        h = merge(h, v2);
+        h = merge(h, v3);
+        h = merge(h, v4);
+    } else {
+        h = seed + PRIME5;
+    }
+    h += std::uint64_t(data.size());
+    for (; (p + 8) <= end; p += 8) {
+        h ^= round(0, read64(p));
+        h = rotl(h, 27) * PRIME1 + PRIME4;
+    }
+    if ((p + 4) <= end) {
+        h ^= std::uint64_t(read32(p)) * PRIME1;
+        h = rotl(h, 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    for (; p < end; ++p) {
+        h ^= (*p) * PRIME5;
+        h = rotl(h, 11) * PRIME1;
+    }
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+std::uint64_t hash_file(std::string const &path, int threads) {
+    file_map f;
+    if (!f.open(path)) {
+        return 0;
+    }
+    auto data = f.data();
+    if (data.size() <= CHUNK_SIZE) {
+        return hash_data(data);
+    }
+    std::size_t nchunks = (data.size() + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    std::vector<std::uint64_t> hashes(nchunks);
+    std::atomic<std::size_t> next{0};
+    auto work = [&data, &hashes, &next, nchunks]() {
+        for (;;) {
+            auto i = next++;
+            if (i >= nchunks) {
+                return;
+            }
+            hashes[i] = hash_data(data.substr(i * CHUNK_SIZE, CHUNK_SIZE));
+        }
+    };
+    int nhelpers = 0;
+    if (nchunks >= PARALLEL_CHUNKS) {
+        nhelpers = helpers_reserve(
+            std::min(threads, int(nchunks)) - 1, threads - 1
+        );
+    }
+    std::vector<std::thread> workers;
+    for (int i = 0; i < nhelpers; ++i) {
+        workers.emplace_back(work);
+    }
+    work();
+    for (auto &t: workers) {
+        t.join();
+    }
+    helpers_running -= nhelpers;
+    return hash_data(std::string_view{
+        reinterpret_cast<char const *>(hashes.data()),
+        hashes.size() * sizeof(std::uint64_t)
+    }, std::uint64_t(data.size()));
+}
+
+} /* namespace obuild */
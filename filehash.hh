@@ -0,0 +1,24 @@
+#ifndef OBUILD_FILEHASH_HH
+#define OBUILD_FILEHASH_HH
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace obuild {
+
+/* XXH64 of the data; unlike hash_string, it consumes 32 bytes per round
+ * and is meant for file contents
+ */
+std::uint64_t hash_data(std::string_view data, std::uint64_t seed = 0);
+
+/* of the contents of a file, 0 if it cannot be read; big files are hashed
+ * in chunks on up to the given number of threads, the result does not
+ * depend on their number; the extra threads are shared by all calls, so
+ * that concurrent calls with the same number never exceed it together
+ */
+std::uint64_t hash_file(std::string const &path, int threads = 1);
+
+} /* namespace obuild */
+
+#endif
@@ -0,0 +1,685 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <string_view>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+#include <ostd/platform.hh>
+
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef OSTD_PLATFORM_LINUX
+#include <sys/syscall.h>
+#endif
+
+#include "glob.hh"
+
+namespace obuild {
+
+static constexpr char const *CACHE_HEADER = "# obuild glob 2\n";
+
+/* consecutive ** are one */
+static constexpr std::string_view GLOB_ANY = "**";
+
+static bool has_wildcard(std::string_view s) {
+    return s.find_first_of("*?[") != s.npos;
+}
+
+static std::string path_join(std::string const &base, std::string_view name) {
+    if (base.empty()) {
+        return std::string{name};
+    }
+    std::string ret = base;
+    if (ret.back() != '/') {
+        ret += '/';
+    }
+    ret += name;
+    return ret;
+}
+
+static void path_split(
+    std::string_view path, std::vector<std::string> &comps
+) {
+    for (;;) {
+        auto sep = path.find('/');
+        auto comp = path.substr(0, sep);
+        if (!comp.empty() && (comp != ".") && (
+            (comp != GLOB_ANY) || comps.empty() || (comps.back() != GLOB_ANY)
+        )) {
+            comps.emplace_back(comp);
+        }
+        if (sep == path.npos) {
+            break;
+        }
+        path = path.substr(sep + 1);
+    }
+}
+
+/* {a,b} alternatives, possibly nested, in the order they are written */
+static void brace_expand(
+    std::string const &pat, std::vector<std::string> &out
+) {
+    std::size_t depth = 0, open = pat.npos;
+    std::vector<std::size_t> commas;
+    for (std::size_t i = 0; i < pat.size(); ++i) {
+        if (pat[i] == '{') {
+            if (!depth++) {
+                open = i;
+                commas.clear();
+            }
+        } else if ((pat[i] == ',') && (depth == 1)) {
+            commas.push_back(i);
+        } else if ((pat[i] == '}') && depth && !--depth) {
+            if (commas.empty()) {
+                /* nothing to choose from, taken literally */
+                continue;
+            }
+            commas.push_back(i);
+            auto prefix = pat.substr(0, open);
+            auto suffix = pat.substr(i + 1);
+            std::size_t start = open + 1;
+            for (auto c: commas) {
+                brace_expand(
+                    prefix + pat.substr(start, c - start) + suffix, out
+                );
+                start = c + 1;
+            }
+            return;
+        }
+    }
+    out.push_back(pat);
+}
+
+namespace {
+
+struct glob_exclude {
+    std::vector<std::string> comps;
+    /* with a slash, matched against the whole path, else against names */
+    bool anchored;
+};
+
+struct glob_item {
+    std::string path;
+    /* the pattern components that may match the entries of the path */
+    std::vector<std::size_t> active;
+};
+
+struct glob_walk {
+    std::vector<std::string> comps;
+    std::vector<glob_exclude> excludes;
+    std::string root;
+
+    std::mutex lock;
+    std::condition_variable cond;
+    std::deque<glob_item> queue;
+    std::size_t busy = 0;
+    std::vector<std::string> out;
+    std::vector<std::pair<std::string, file_info>> dirs;
+
+    void activate(std::vector<std::size_t> &active, std::size_t i) const;
+    bool excluded(std::string const &path, std::string_view name) const;
+    void process(
+        glob_item const &item, std::vector<glob_item> &items,
+        std::vector<std::string> &lout,
+        std::vector<std::pair<std::string, file_info>> &ldirs
+    ) const;
+    void work();
+    void run(int threads);
+};
+
+} /* namespace */
+
+/* a ** also lets the following component match at the same level */
+void glob_walk::activate(
+    std::vector<std::size_t> &active, std::size_t i
+) const {
+    while (i < comps.size()) {
+        active.push_back(i);
+        if ((comps[i] != GLOB_ANY) || ((i + 1) == comps.size())) {
+            break;
+        }
+        ++i;
+    }
+}
+
+static bool match_path(
+    std::vector<std::string> const &pc, std::size_t pi,
+    std::vector<std::string> const &xc, std::size_t xi
+) {
+    if (xi == xc.size()) {
+        return pi == pc.size();
+    }
+    if (xc[xi] == GLOB_ANY) {
+        for (std::size_t k = pi; k <= pc.size(); ++k) {
+            if (match_path(pc, k, xc, xi + 1)) {
+                return true;
+            }
+        }
+        return false;
+    }
+    return (pi < pc.size()) && !fnmatch(
+        xc[xi].data(), pc[pi].data(), 0
+    ) && match_path(pc, pi + 1, xc, xi + 1);
+}
+
+bool glob_walk::excluded(
+    std::string const &path, std::string_view name
+) const {
+    std::vector<std::string> pc;
+    std::string nbuf;
+    for (auto &ex: excludes) {
+        if (!ex.anchored) {
+            if (nbuf.empty()) {
+                nbuf = name;
+            }
+            if (!fnmatch(ex.comps[0].data(), nbuf.data(), 0)) {
+                return true;
+            }
+            continue;
+        }
+        if (pc.empty()) {
+            path_split(path, pc);
+        }
+        if (match_path(pc, 0, ex.comps, 0)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* the entries of a directory in large batches, with their d_type */
+template<typename F>
+static bool read_dir(int fd, F &&func) {
+#ifdef OSTD_PLATFORM_LINUX
+    alignas(8) char buf[32768];
+    for (;;) {
+        auto n = syscall(SYS_getdents64, fd, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (!n) {
+            return true;
+        }
+        /* struct linux_dirent64: ino, off, reclen, type, name */
+        for (long off = 0; off < n;) {
+            unsigned short reclen;
+            std::memcpy(&reclen, buf + off + 16, sizeof(reclen));
+            func(buf + off + 19, static_cast<unsigned char>(buf[off + 18]));
+            off += reclen;
+        }
+    }
+#else
+    DIR *d = fdopendir(dup(fd));
+    if (!d) {
+        return false;
+    }
+    while (dirent *de = readdir(d)) {
+        func(de->d_name, de->d_type);
+    }
+    closedir(d);
+    return true;
+#endif
+}
+
+/* the entries counted by the listing hash */
+static bool listed(std::string_view name) {
+    return (name != ".") && (name != "..") && (
+        name.substr(0, std::strlen(STATE_PREFIX)) != STATE_PREFIX
+    );
+}
+
+/* a sum, so that the order of the entries on disk does not matter */
+static std::uint64_t listing_end(std::uint64_t h) {
+    return h ? h : 1;
+}
+
+std::uint64_t dir_hash(std::string const &path) {
+    int fd = ::open(
+        path.empty() ? "." : path.data(), O_RDONLY | O_DIRECTORY | O_CLOEXEC
+    );
+    if (fd < 0) {
+        return 0;
+    }
+    std::uint64_t h = 0;
+    bool ok = read_dir(fd, [&h](char const *name, unsigned char) {
+        if (listed(name)) {
+            h += hash_string(name);
+        }
+    });
+    ::close(fd);
+    return ok ? listing_end(h) : 0;
+}
+
+bool dir_unchanged(std::string const &path, file_info &recorded) {
+    auto fi = stat_file(path);
+    if (fi == recorded) {
+        return true;
+    }
+    /* e.g. only the state files of a build in it were replaced */
+    if (
+        !fi.exists() || !recorded.hash || (dir_hash(path) != recorded.hash)
+    ) {
+        return false;
+    }
+    recorded.mtime = fi.mtime;
+    recorded.size = fi.size;
+    return true;
+}
+
+/* the stat info of a directory along with its listing hash */
+static file_info dir_info(std::string const &path) {
+    auto ret = stat_file(path);
+    if (ret.exists()) {
+        ret.hash = dir_hash(path);
+    }
+    return ret;
+}
+
+void glob_walk::process(
+    glob_item const &item, std::vector<glob_item> &items,
+    std::vector<std::string> &lout,
+    std::vector<std::pair<std::string, file_info>> &ldirs
+) const {
+    std::string dname = item.path.empty() ? std::string{"."} : item.path;
+    if (item.active.size() == 1) {
+        auto i = item.active[0];
+        auto &comp = comps[i];
+        if ((comp != GLOB_ANY) && !has_wildcard(comp)) {
+            /* no need to read the directory */
+            auto path = path_join(item.path, comp);
+            if (excluded(path, comp)) {
+                return;
+            }
+            if ((i + 1) < comps.size()) {
+                /* the next level records it, missing or not */
+                glob_item next{std::move(path), {}};
+                activate(next.active, i + 1);
+                items.push_back(std::move(next));
+                return;
+            }
+            /* whether the entry exists is up to the directory */
+            ldirs.emplace_back(dname, dir_info(dname));
+            if (stat_file(path).exists()) {
+                lout.push_back(std::move(path));
+            }
+            return;
+        }
+    }
+    int fd = ::open(dname.data(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        ldirs.emplace_back(dname, stat_file(dname));
+        return;
+    }
+    auto di = ldirs.size();
+    ldirs.emplace_back(dname, stat_file(fd));
+    std::uint64_t h = 0;
+    bool ok = read_dir(fd, [&](char const *name, unsigned char type) {
+        std::string_view nv{name};
+        if ((nv == ".") || (nv == "..")) {
+            return;
+        }
+        if (listed(nv)) {
+            h += hash_string(nv);
+        }
+        std::string path = path_join(item.path, nv);
+        if (excluded(path, nv)) {
+            return;
+        }
+        /* ** does not follow symlinks, so that it cannot loop */
+        bool dir = (type == DT_DIR), link = (type == DT_LNK);
+        if ((type == DT_UNKNOWN) || link) {
+            struct stat st;
+            if (!link && !lstat(path.data(), &st) && S_ISLNK(st.st_mode)) {
+                link = true;
+            }
+            dir = !stat(path.data(), &st) && S_ISDIR(st.st_mode);
+        }
+        bool matched = false;
+        glob_item next{std::string{}, {}};
+        for (auto i: item.active) {
+            bool last = (i + 1) == comps.size();
+            if (comps[i] == GLOB_ANY) {
+                if (name[0] == '.') {
+                    continue;
+                }
+                matched = matched || last;
+                if (dir && !link) {
+                    activate(next.active, i);
+                }
+            } else if (!fnmatch(comps[i].data(), name, FNM_PERIOD)) {
+                matched = matched || last;
+                if (dir && !last) {
+                    activate(next.active, i + 1);
+                }
+            }
+        }
+        if (!next.active.empty()) {
+            std::sort(next.active.begin(), next.active.end());
+            next.active.erase(std::unique(
+                next.active.begin(), next.active.end()
+            ), next.active.end());
+            next.path = path;
+            items.push_back(std::move(next));
+        }
+        if (matched) {
+            lout.push_back(std::move(path));
+        }
+    });
+    ::close(fd);
+    if (ok) {
+        ldirs[di].second.hash = listing_end(h);
+    }
+}
+
+void glob_walk::work() {
+    std::vector<std::string> lout;
+    std::vector<std::pair<std::string, file_info>> ldirs;
+    std::vector<glob_item> items;
+    std::unique_lock<std::mutex> l{lock};
+    for (;;) {
+        cond.wait(l, [this]() {
+            return !queue.empty() || !busy;
+        });
+        if (queue.empty()) {
+            break;
+        }
+        auto item = std::move(queue.front());
+        queue.pop_front();
+        ++busy;
+        l.unlock();
+        process(item, items, lout, ldirs);
+        l.lock();
+        for (auto &it: items) {
+            queue.push_back(std::move(it));
+        }
+        items.clear();
+        --busy;
+        cond.notify_all();
+    }
+    out.insert(out.end(), lout.begin(), lout.end());
+    dirs.insert(dirs.end(), ldirs.begin(), ldirs.end());
+}
+
+void glob_walk::run(int threads) {
+    glob_item first{root, {}};
+    activate(first.active, 0);
+    queue.push_back(std::move(first));
+    /* only recursion has enough directories to be worth it */
+    if (std::find(comps.begin(), comps.end(), GLOB_ANY) == comps.end()) {
+        threads = 1;
+    }
+    std::vector<std::thread> workers;
+    for (int i = 1; i < threads; ++i) {
+        workers.emplace_back([this]() {
+            work();
+        });
+    }
+    work();
+    for (auto &t: workers) {
+        t.join();
+    }
+}
+
+void glob_expand(
+    std::string const &pattern, std::vector<std::string> const &excludes,
+    std::vector<std::string> &out,
+    std::vector<std::pair<std::string, file_info>> &dirs, int threads
+) {
+    std::vector<glob_exclude> exs;
+    for (auto &ex: excludes) {
+        std::vector<std::string> exp;
+        brace_expand(ex, exp);
+        for (auto &e: exp) {
+            glob_exclude gex;
+            std::string_view ev = e;
+            while ((ev.size() > 1) && (ev.back() == '/')) {
+                ev.remove_suffix(1);
+            }
+            gex.anchored = (ev.find('/') != ev.npos);
+            path_split(ev, gex.comps);
+            if (!gex.comps.empty()) {
+                exs.push_back(std::move(gex));
+            }
+        }
+    }
+    std::vector<std::string> pats;
+    brace_expand(pattern, pats);
+    auto first = out.size();
+    auto dfirst = dirs.size();
+    for (auto &pat: pats) {
+        glob_walk gw;
+        path_split(pat, gw.comps);
+        if (gw.comps.empty()) {
+            continue;
+        }
+        if (pat[0] == '/') {
+            gw.root = "/";
+        }
+        gw.excludes = exs;
+        gw.run(threads);
+        out.insert(out.end(), gw.out.begin(), gw.out.end());
+        dirs.insert(dirs.end(), gw.dirs.begin(), gw.dirs.end());
+    }
+    std::sort(out.begin() + first, out.end());
+    out.erase(std::unique(out.begin() + first, out.end()), out.end());
+    std::sort(dirs.begin() + dfirst, dirs.end(), [](
+        auto const &a, auto const &b
+    ) {
+        return a.first < b.first;
+    });
+    dirs.erase(std::unique(dirs.begin() + dfirst, dirs.end(), [](
+        auto const &a, auto const &b
+    ) {
+        return a.first == b.first;
+    }), dirs.end());
+}
+
+bool glob_cache::open(std::string path) {
+    p_path = std::move(path);
+    std::string buf;
+    if (!read_file(p_path, buf)) {
+        return false;
+    }
+    std::string_view data = buf;
+    std::string_view hdr{CACHE_HEADER};
+    if (data.substr(0, hdr.size()) != hdr) {
+        return false;
+    }
+    data.remove_prefix(hdr.size());
+    /* pattern, number of directories, the directories with their stat
+     * info and listing hash and then the matches, all separated by tabs
+     */
+    while (!data.empty()) {
+        auto nl = data.find('\n');
+        if (nl == data.npos) {
+            break;
+        }
+        auto line = data.substr(0, nl);
+        data.remove_prefix(nl + 1);
+        std::vector<std::string> fs;
+        for (;;) {
+            auto tab = line.find('\t');
+            fs.emplace_back(line.substr(0, tab));
+            if (tab == line.npos) {
+                break;
+            }
+            line.remove_prefix(tab + 1);
+        }
+        if (fs.size() < 2) {
+            continue;
+        }
+        auto ndirs = std::size_t(std::strtoull(fs[1].data(), nullptr, 10));
+        if (fs.size() < (2 + ndirs * 4)) {
+            continue;
+        }
+        result res;
+        std::size_t i = 2;
+        for (std::size_t n = 0; n < ndirs; ++n, i += 4) {
+            res.dirs.emplace_back(fs[i], file_info{
+                std::strtoll(fs[i + 1].data(), nullptr, 10),
+                std::strtoll(fs[i + 2].data(), nullptr, 10),
+                std::strtoull(fs[i + 3].data(), nullptr, 16)
+            });
+        }
+        for (; i < fs.size(); ++i) {
+            res.matches.push_back(std::move(fs[i]));
+        }
+        p_entries[fs[0]] = std::move(res);
+    }
+    return true;
+}
+
+glob_cache::result const &glob_cache::match(
+    std::string const &pattern, std::vector<std::string> const &excludes
+) {
+    /* a separator that cannot be part of a list item */
+    std::string key = pattern;
+    for (auto &ex: excludes) {
+        key += '\x1F';
+        key += ex;
+    }
+    auto it = p_entries.find(key);
+    if (it != p_entries.end()) {
+        auto &res = it->second;
+        if (res.checked) {
+            return res;
+        }
+        /* stat is much cheaper than reading the directory */
+        if (std::all_of(res.dirs.begin(), res.dirs.end(), [this](auto &d) {
+            auto old = d.second;
+            if (!dir_unchanged(d.first, d.second)) {
+                return false;
+            }
+            /* refreshed, save it so the next run gets by with the stat */
+            if (!(d.second == old)) {
+                p_dirty = true;
+            }
+            return true;
+        })) {
+            res.checked = true;
+            return res;
+        }
+    }
+    result res;
+    glob_expand(pattern, excludes, res.matches, res.dirs, threads);
+    res.checked = true;
+    p_dirty = true;
+    auto &ret = p_entries[key];
+    ret = std::move(res);
+    return ret;
+}
+
+bool glob_cache::changed(
+    std::string const &dir, std::vector<std::string> &dirs
+) {
+    bool found = false;
+    for (auto &p: p_entries) {
+        auto &res = p.second;
+        if (!res.checked || std::none_of(
+            res.dirs.begin(), res.dirs.end(), [&dir](auto &d) {
+                return d.first == dir;
+            }
+        )) {
+            continue;
+        }
+        found = true;
+        /* the key is the pattern followed by the excludes */
+        std::vector<std::string> pats;
+        std::string_view key = p.first;
+        for (;;) {
+            auto sep = key.find('\x1F');
+            pats.emplace_back(key.substr(0, sep));
+            if (sep == key.npos) {
+                break;
+            }
+            key.remove_prefix(sep + 1);
+        }
+        auto pattern = std::move(pats.front());
+        pats.erase(pats.begin());
+        result now;
+        glob_expand(pattern, pats, now.matches, now.dirs, threads);
+        if (now.matches != res.matches) {
+            return true;
+        }
+        for (auto &d: now.dirs) {
+            if (std::none_of(res.dirs.begin(), res.dirs.end(), [&d](auto &od) {
+                return od.first == d.first;
+            })) {
+                dirs.push_back(d.first);
+            }
+        }
+        res.dirs = std::move(now.dirs);
+        p_dirty = true;
+    }
+    return !found;
+}
+
+static bool cache_field(std::string_view s) {
+    return s.find_first_of("\t\n") == s.npos;
+}
+
+bool glob_cache::save() {
+    if (!p_dirty || p_path.empty()) {
+        return true;
+    }
+    std::string buf{CACHE_HEADER};
+    char nbuf[64];
+    for (auto &p: p_entries) {
+        auto &res = p.second;
+        bool valid = cache_field(p.first);
+        for (auto &d: res.dirs) {
+            valid = valid && cache_field(d.first);
+        }
+        for (auto &m: res.matches) {
+            valid = valid && cache_field(m);
+        }
+        if (!valid) {
+            continue;
+        }
+        buf += p.first;
+        std::snprintf(nbuf, sizeof(nbuf), "\t%zu", res.dirs.size());
+        buf += nbuf;
+        for (auto &d: res.dirs) {
+            buf += '\t';
+            buf += d.first;
+            std::snprintf(
+                nbuf, sizeof(nbuf), "\t%lld\t%lld\t%llx",
+                static_cast<long long>(d.second.mtime),
+                static_cast<long long>(d.second.size),
+                static_cast<unsigned long long>(d.second.hash)
+            );
+            buf += nbuf;
+        }
+        for (auto &m: res.matches) {
+            buf += '\t';
+            buf += m;
+        }
+        buf += '\n';
+    }
+    auto tmp = p_path + ".tmp";
+    std::FILE *f = std::fopen(tmp.data(), "wb");
+    if (!f) {
+        return false;
+    }
+    bool ret = (std::fwrite(buf.data(), 1, buf.size(), f) == buf.size());
+    ret = !std::fclose(f) && ret;
+    if (ret && !std::rename(tmp.data(), p_path.data())) {
+        p_dirty = false;
+        return true;
+    }
+    return false;
+}
+
+} /* namespace obuild */
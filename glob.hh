@@ -0,0 +1,42 @@
+#ifndef OBUILD_GLOB_HH
+#define OBUILD_GLOB_HH
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <utility>
+
+#include "state.hh"
+
+namespace obuild {
+
+/* expands a shell pattern into the sorted existing paths matching it:
+ * *, ? and [...] match within a path component, ** matches any number
+ * of directories (not following symlinks) and {a,b} expands into both;
+ * paths matching an exclude are skipped along with everything below
+ * them, an exclude without a slash matches names at any depth
+ *
+ * every directory whose entries were needed for the outcome ends up in
+ * dirs; recursive patterns read directories on several threads
+ */
+void glob_expand(
+    std::string const &pattern, std::vector<std::string> const &excludes,
+    std::vector<std::string> &out,
+    std::vector<std::pair<std::string, file_info>> &dirs, int threads = 1
+);
+
+/* of the names in a directory, not counting obuild's own state files,
+ * which change on every build; 0 if it cannot be read
+ */
+std::uint64_t dir_hash(std::string const &path);
+
+/* whether a directory has the same entries as when it was recorded;
+ * only read if its stat info changed and the listing hash is known, in
+ * which case the record gets the new stat info so that it is not read
+ * again next time
+ */
+bool dir_unchanged(std::string const &path, file_info &recorded);
+
+} /* namespace obuild */
+
+#endif
@@ -0,0 +1,137 @@
+#include "graph.hh"
+
+namespace obuild {
+
+void rule_graph::add(
+    std::string_view target, std::vector<std::string> deps,
+    body_hash body, bool action, bool restat
+) {
+    auto idx = p_rules.size();
+    p_rules.push_back(rule{
+        std::string{target}, std::move(deps), std::move(body), action, restat
+    });
+    if (target.find('%') != std::string_view::npos) {
+        p_patterns.push_back(idx);
+    } else {
+        p_exact[p_rules.back().target].push_back(idx);
+    }
+}
+
+void rule_graph::add_implicit(
+    std::string_view target, std::vector<std::string> deps
+) {
+    p_implicit[std::string{target}] = std::move(deps);
+}
+
+void rule_graph::add_order(
+    std::string_view target, std::vector<std::string> deps
+) {
+    auto &v = p_order[std::string{target}];
+    for (auto &dep: deps) {
+        v.push_back(std::move(dep));
+    }
+}
+
+void rule_graph::add_group(
+    std::string_view primary, std::vector<std::string> others
+) {
+    p_groups[std::string{primary}] = std::move(others);
+}
+
+/* on success, sub is set to the part of the target matched by % */
+static bool match_pattern(
+    std::string_view target, std::string_view pattern, std::string_view &sub
+) {
+    auto pct = pattern.find('%');
+    auto pre = pattern.substr(0, pct);
+    auto suf = pattern.substr(pct + 1);
+    if (
+        (target.size() <= (pre.size() + suf.size())) ||
+        (target.substr(0, pre.size()) != pre) ||
+        (target.substr(target.size() - suf.size()) != suf)
+    ) {
+        return false;
+    }
+    sub = target.substr(pre.size(), target.size() - pre.size() - suf.size());
+    return true;
+}
+
+rule_graph::node rule_graph::resolve(std::string const &target) const {
+    node ret;
+    auto iit = p_implicit.find(target);
+    if (iit != p_implicit.end()) {
+        ret.implicit = iit->second;
+    }
+    auto oit = p_order.find(target);
+    if (oit != p_order.end()) {
+        ret.order = oit->second;
+    }
+    auto git = p_groups.find(target);
+    if (git != p_groups.end()) {
+        ret.group = git->second;
+    }
+    rule const *brule = nullptr;
+    auto it = p_exact.find(target);
+    if (it != p_exact.end()) {
+        for (auto idx: it->second) {
+            auto &r = p_rules[idx];
+            ret.found = true;
+            ret.action = ret.action || r.action;
+            ret.restat = ret.restat || r.restat;
+            if (r.body && !brule) {
+                brule = &r;
+            }
+        }
+    }
+    /* the deps of the rule with the body come first, so that it is
+     * the one that determines the first source
+     */
+    if (brule) {
+        ret.body = brule->body;
+        ret.deps = brule->deps;
+    } else {
+        /* the pattern rule with the shortest stem wins */
+        rule const *best = nullptr;
+        std::string_view bsub;
+        for (auto idx: p_patterns) {
+            auto &r = p_rules[idx];
+            std::string_view sub;
+            if (!r.body || !match_pattern(target, r.target, sub)) {
+                continue;
+            }
+            if (!best || (sub.size() < bsub.size())) {
+                best = &r;
+                bsub = sub;
+            }
+        }
+        if (best) {
+            ret.found = true;
+            ret.body = best->body;
+            ret.action = ret.action || best->action;
+            ret.restat = ret.restat || best->restat;
+            for (auto &dep: best->deps) {
+                auto pct = dep.find('%');
+                if (pct == dep.npos) {
+                    ret.deps.push_back(dep);
+                    continue;
+                }
+                std::string d{dep, 0, pct};
+                d += bsub;
+                d.append(dep, pct + 1, dep.npos);
+                ret.deps.push_back(std::move(d));
+            }
+        }
+    }
+    if (it == p_exact.end()) {
+        return ret;
+    }
+    for (auto idx: it->second) {
+        auto &r = p_rules[idx];
+        if (&r != brule) {
+            ret.deps.insert(ret.deps.end(), r.deps.begin(), r.deps.end());
+        }
+    }
+    return ret;
+}
+
+} /* namespace obuild */
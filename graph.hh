@@ -0,0 +1,99 @@
+#ifndef OBUILD_GRAPH_HH
+#define OBUILD_GRAPH_HH
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <cstdint>
+
+namespace obuild {
+
+/* evaluates a rule body without running anything and returns the hash
+ * of the commands it would run for the given target and sources
+ */
+using body_hash = std::function<
+    std::uint64_t(std::string const &, std::vector<std::string> const &)
+>;
+
+/* mirrors the rules registered with build::make, so that obuild itself
+ * can reason about the graph (for instance to detect null builds)
+ */
+struct rule_graph {
+    struct node {
+        std::vector<std::string> deps;
+        /* discovered dependencies built by other rules, only for ordering */
+        std::vector<std::string> implicit;
+        /* built before the target, but never making it stale */
+        std::vector<std::string> order;
+        /* the other outputs if the body produces several at once */
+        std::vector<std::string> group;
+        body_hash body;
+        bool found = false;
+        bool action = false;
+        /* the output is hashed, so that dependents only rebuild once
+         * its contents change
+         */
+        bool restat = false;
+    };
+
+    void add(
+        std::string_view target, std::vector<std::string> deps,
+        body_hash body, bool action, bool restat = false
+    );
+
+    void add_implicit(std::string_view target, std::vector<std::string> deps);
+
+    /* appends to the order-only dependencies of the target */
+    void add_order(std::string_view target, std::vector<std::string> deps);
+
+    /* the body of the primary target also produces the others */
+    void add_group(std::string_view primary, std::vector<std::string> others);
+
+    /* merges all rules applying to the target like build::make does */
+    node resolve(std::string const &target) const;
+
+    /* calls the function for every rule in the order they were added */
+    template<typename F>
+    void each(F &&func) const {
+        for (auto &r: p_rules) {
+            func(r.target, r.deps, !!r.body, r.action, r.restat);
+        }
+    }
+
+    template<typename F>
+    void each_order(F &&func) const {
+        for (auto &p: p_order) {
+            func(p.first, p.second);
+        }
+    }
+
+    template<typename F>
+    void each_group(F &&func) const {
+        for (auto &p: p_groups) {
+            func(p.first, p.second);
+        }
+    }
+
+private:
+    struct rule {
+        std::string target;
+        std::vector<std::string> deps;
+        body_hash body;
+        bool action;
+        bool restat;
+    };
+
+    std::vector<rule> p_rules;
+    std::unordered_map<std::string, std::vector<std::size_t>> p_exact;
+    std::vector<std::size_t> p_patterns;
+    std::unordered_map<std::string, std::vector<std::string>> p_implicit;
+    std::unordered_map<std::string, std::vector<std::string>> p_order;
+    std::unordered_map<std::string, std::vector<std::string>> p_groups;
+};
+
+} /* namespace obuild */
+
+#endif
@@ -0,0 +1,139 @@
+#include <cstdio>
+#include <cstdlib>
+#include <string_view>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "hashes.hh"
+#include "filehash.hh"
+#include "state.hh"
+
+namespace obuild {
+
+static constexpr char const *CACHE_HEADER = "# obuild hashes 2\n";
+
+/* files modified this recently may still change within the same
+ * timestamp, their hashes are not kept across runs
+ */
+static constexpr std::int64_t RACY_NS = 2000000000;
+
+hash_cache::~hash_cache() {
+    save();
+}
+
+bool hash_cache::open(std::string path) {
+    p_path = std::move(path);
+    std::string buf;
+    if (!read_file(p_path, buf)) {
+        return false;
+    }
+    std::string_view data = buf;
+    std::string_view hdr{CACHE_HEADER};
+    if (data.substr(0, hdr.size()) != hdr) {
+        return false;
+    }
+    data.remove_prefix(hdr.size());
+    /* device, inode, size, mtime, hash and the path, tab separated */
+    while (!data.empty()) {
+        auto nl = data.find('\n');
+        if (nl == data.npos) {
+            break;
+        }
+        auto line = data.substr(0, nl);
+        data.remove_prefix(nl + 1);
+        std::vector<std::string> fs;
+        for (std::size_t i = 0; i < 5; ++i) {
+            auto tab = line.find('\t');
+            if (tab == line.npos) {
+                break;
+            }
+            fs.emplace_back(line.substr(0, tab));
+            line.remove_prefix(tab + 1);
+        }
+        if ((fs.size() != 5) || line.empty()) {
+            continue;
+        }
+        p_entries[std::string{line}] = entry{
+            std::strtoull(fs[0].data(), nullptr, 10),
+            std::strtoull(fs[1].data(), nullptr, 10),
+            std::strtoll(fs[2].data(), nullptr, 10),
+            std::strtoll(fs[3].data(), nullptr, 10),
+            std::strtoull(fs[4].data(), nullptr, 16)
+        };
+    }
+    return true;
+}
+
+bool hash_cache::save() {
+    std::lock_guard<std::mutex> l{p_lock};
+    if (!p_dirty || p_path.empty()) {
+        return true;
+    }
+    auto racy = time_ms() * 1000000 - RACY_NS;
+    std::string buf{CACHE_HEADER};
+    char nbuf[128];
+    for (auto &p: p_entries) {
+        auto &e = p.second;
+        if (
+            (e.mtime >= racy) || (p.first.find_first_of("\n") != p.first.npos)
+        ) {
+            continue;
+        }
+        std::snprintf(
+            nbuf, sizeof(nbuf), "%llu\t%llu\t%lld\t%lld\t%llx\t",
+            static_cast<unsigned long long>(e.dev),
+            static_cast<unsigned long long>(e.ino),
+            static_cast<long long>(e.size), static_cast<long long>(e.mtime),
+            static_cast<unsigned long long>(e.hash)
+        );
+        buf += nbuf;
+        buf += p.first;
+        buf += '\n';
+    }
+    auto tmp = p_path + ".tmp";
+    std::FILE *f = std::fopen(tmp.data(), "wb");
+    if (!f) {
+        return false;
+    }
+    bool ret = (std::fwrite(buf.data(), 1, buf.size(), f) == buf.size());
+    ret = !std::fclose(f) && ret;
+    if (ret && !std::rename(tmp.data(), p_path.data())) {
+        p_dirty = false;
+        return true;
+    }
+    return false;
+}
+
+std::uint64_t hash_cache::get(std::string const &path) {
+    struct stat st;
+    if (stat(path.data(), &st) || !S_ISREG(st.st_mode)) {
+        return 0;
+    }
+    entry e{
+        std::uint64_t(st.st_dev), std::uint64_t(st.st_ino),
+        std::int64_t(st.st_size), stat_info(st).mtime, 0
+    };
+    {
+        std::lock_guard<std::mutex> l{p_lock};
+        auto it = p_entries.find(path);
+        if ((it != p_entries.end()) && (
+            (it->second.dev == e.dev) && (it->second.ino == e.ino) &&
+            (it->second.size == e.size) && (it->second.mtime == e.mtime)
+        )) {
+            return it->second.hash;
+        }
+    }
+    e.hash = hash_file(path, threads);
+    if (!e.hash) {
+        /* cannot be read, or a very unlikely collision with unknown */
+        return 0;
+    }
+    std::lock_guard<std::mutex> l{p_lock};
+    p_entries[path] = e;
+    p_dirty = true;
+    return e.hash;
+}
+
+} /* namespace obuild */
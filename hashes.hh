@@ -0,0 +1,48 @@
+#ifndef OBUILD_HASHES_HH
+#define OBUILD_HASHES_HH
+
+#include <cstdint>
+#include <string>
+#include <mutex>
+#include <unordered_map>
+
+namespace obuild {
+
+/* content hashes of files, remembered along with the device, inode, size
+ * and modification time of the file they were computed for, so that a
+ * file is only read again once it changed on disk
+ */
+struct hash_cache {
+    hash_cache() {}
+    hash_cache(hash_cache const &) = delete;
+    ~hash_cache();
+
+    hash_cache &operator=(hash_cache const &) = delete;
+
+    bool open(std::string path);
+    bool save();
+
+    /* thread safe; 0 if the file cannot be read */
+    std::uint64_t get(std::string const &path);
+
+    /* for hashing big files, at most this many in total */
+    int threads = 1;
+
+private:
+    struct entry {
+        std::uint64_t dev;
+        std::uint64_t ino;
+        std::int64_t size;
+        std::int64_t mtime;
+        std::uint64_t hash;
+    };
+
+    std::string p_path;
+    std::mutex p_lock;
+    std::unordered_map<std::string, entry> p_entries;
+    bool p_dirty = false;
+};
+
+} /* namespace obuild */
+
+#endif
@@ -0,0 +1,168 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <string_view>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "jobserver.hh"
+
+namespace obuild {
+
+jobserver::~jobserver() {
+    if (!p_owner) {
+        return;
+    }
+    close(p_rfd);
+    close(p_wfd);
+}
+
+static bool fd_valid(int fd) {
+    return (fd >= 0) && (fcntl(fd, F_GETFD) >= 0);
+}
+
+bool jobserver::join() {
+    char const *flags = std::getenv("MAKEFLAGS");
+    if (!flags) {
+        return false;
+    }
+    /* the last one wins, older makes use --jobserver-fds */
+    std::string_view mf{flags}, auth;
+    for (auto opt: {"--jobserver-auth=", "--jobserver-fds="}) {
+        auto pos = mf.rfind(opt);
+        if (pos == mf.npos) {
+            continue;
+        }
+        auth = mf.substr(pos + std::string_view{opt}.size());
+        auth = auth.substr(0, auth.find(' '));
+        break;
+    }
+    if (auth.empty()) {
+        return false;
+    }
+    if (auth.substr(0, 5) == "fifo:") {
+        std::string path{auth.substr(5)};
+        int fd = open(path.data(), O_RDWR | O_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+        p_rfd = p_wfd = fd;
+        /* our own descriptor, children find the fifo by name */
+        p_owner = true;
+        return true;
+    }
+    int rfd = -1, wfd = -1;
+    std::string buf{auth};
+    if (std::sscanf(buf.data(), "%d,%d", &rfd, &wfd) != 2) {
+        return false;
+    }
+    /* make only passes them to commands it knows to be submakes */
+    if (!fd_valid(rfd) || !fd_valid(wfd)) {
+        return false;
+    }
+    p_rfd = rfd;
+    p_wfd = wfd;
+    return true;
+}
+
+bool jobserver::create(int jobs) {
+    int fds[2];
+    /* inherited by children, like make does */
+    if (pipe(fds)) {
+        return false;
+    }
+    std::string tokens(std::size_t(jobs - 1), '+');
+    if (write(fds[1], tokens.data(), tokens.size()) != ssize_t(tokens.size())) {
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    p_rfd = fds[0];
+    p_wfd = fds[1];
+    p_owner = true;
+    std::string mf;
+    if (char const *flags = std::getenv("MAKEFLAGS"); flags) {
+        mf = flags;
+        p_makeflags = mf;
+    }
+    char buf[64];
+    std::snprintf(
+        buf, sizeof(buf), " -j%d --jobserver-auth=%d,%d", jobs, p_rfd, p_wfd
+    );
+    mf += buf;
+    setenv("MAKEFLAGS", mf.data(), 1);
+    p_exported = true;
+    return true;
+}
+
+void jobserver::unexport() {
+    if (!p_exported) {
+        return;
+    }
+    if (p_makeflags) {
+        setenv("MAKEFLAGS", p_makeflags->data(), 1);
+    } else {
+        unsetenv("MAKEFLAGS");
+    }
+    fcntl(p_rfd, F_SETFD, FD_CLOEXEC);
+    fcntl(p_wfd, F_SETFD, FD_CLOEXEC);
+    p_exported = false;
+}
+
+bool jobserver::read_token(char &c) {
+    for (;;) {
+        auto ret = read(p_rfd, &c, 1);
+        if (ret == 1) {
+            return true;
+        }
+        if (!ret) {
+            /* the server went away */
+            return false;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN) {
+            return false;
+        }
+        /* someone made the shared pipe non-blocking */
+        pollfd pfd{p_rfd, POLLIN, 0};
+        poll(&pfd, 1, -1);
+    }
+}
+
+void jobserver::acquire() {
+    {
+        std::lock_guard<std::mutex> l{p_lock};
+        if (p_implicit) {
+            p_implicit = false;
+            return;
+        }
+    }
+    char c;
+    if (!read_token(c)) {
+        /* without a usable jobserver, the pool size is the only limit */
+        c = 0;
+    }
+    std::lock_guard<std::mutex> l{p_lock};
+    p_tokens.push_back(c);
+}
+
+void jobserver::release() {
+    std::lock_guard<std::mutex> l{p_lock};
+    if (p_tokens.empty()) {
+        p_implicit = true;
+        return;
+    }
+    char c = p_tokens.back();
+    p_tokens.pop_back();
+    if (!c) {
+        return;
+    }
+    while ((write(p_wfd, &c, 1) < 0) && (errno == EINTR)) {
+    }
+}
+
+} /* namespace obuild */
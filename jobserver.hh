@@ -0,0 +1,58 @@
+#ifndef OBUILD_JOBSERVER_HH
+#define OBUILD_JOBSERVER_HH
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <optional>
+
+namespace obuild {
+
+/* GNU make's jobserver protocol, so that one token budget governs a whole
+ * tree of builds; the jobserver is a pipe (or a named fifo) holding one
+ * byte per job beyond the one every participant implicitly has, which is
+ * read before running a job and written back once it is done
+ */
+struct jobserver {
+    jobserver() {}
+    jobserver(jobserver const &) = delete;
+    ~jobserver();
+
+    jobserver &operator=(jobserver const &) = delete;
+
+    /* joins the jobserver passed in MAKEFLAGS, false if there is none */
+    bool join();
+
+    /* creates a jobserver for the given number of jobs and exports it to
+     * child processes through MAKEFLAGS
+     */
+    bool create(int jobs);
+
+    /* undoes what create exported, before the process replaces itself
+     * with exec; the pipe is not passed on either, as the new image
+     * creates its own
+     */
+    void unexport();
+
+    /* thread safe, blocks until a job may run */
+    void acquire();
+    void release();
+
+private:
+    bool read_token(char &c);
+
+    int p_rfd = -1;
+    int p_wfd = -1;
+    bool p_owner = false;
+    bool p_exported = false;
+    /* what MAKEFLAGS was before create, if set */
+    std::optional<std::string> p_makeflags;
+    std::mutex p_lock;
+    bool p_implicit = true;
+    /* make may give the bytes a meaning, they are written back as read */
+    std::vector<char> p_tokens;
+};
+
+} /* namespace obuild */
+
+#endif
@@ -1,6 +1,17 @@
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
 #include <utility>
+#include <algorithm>
+#include <memory>
 #include <vector>
 #include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <poll.h>
+#include <unistd.h>
 
 #include <ostd/string.hh>
 #include <ostd/format.hh>
@@ -9,119 +20,626 @@
 #include <ostd/platform.hh>
 #include <ostd/environ.hh>
 #include <ostd/argparse.hh>
+#include <ostd/coroutine.hh>
 
 #include <ostd/build/make.hh>
 #include <ostd/build/make_coroutine.hh>
 
 #include <cubescript/cubescript.hh>
 
+#include "state.hh"
+#include "spawn.hh"
+#include "cache.hh"
+#include "trace.hh"
+#include "jobserver.hh"
+#include "throttle.hh"
+#include "pool.hh"
+#include "watch.hh"
+#include "server.hh"
+#include "hashes.hh"
+#include "filehash.hh"
+
 namespace cs = cubescript;
 namespace fs = ostd::fs;
 namespace build = ostd::build;
 
-static void rule_add(
-    cs::state &cs, build::make &mk,
-    std::string_view target, std::string_view depends,
-    cs::bcode_ref body, bool action = false
+static std::shared_ptr<obuild::build_job> job_new(
+    obuild::build_state &bst, std::string_view tgt,
+    std::vector<std::string_view> const &srcs
 ) {
-    build::make_rule::body_func bodyf{};
-    if (!body.empty()) {
-        bodyf = [body, &cs](auto tgt, auto srcs) {
-            auto ts = cs.new_thread();
-            cs::alias_local target{ts, "target"};
-            cs::alias_local source{ts, "source"};
-            cs::alias_local sources{ts, "sources"};
+    auto job = std::make_shared<obuild::build_job>(bst, std::string{tgt});
+    /* the dependencies are all built at this point */
+    for (auto src: srcs) {
+        std::string sname{src};
+        auto fi = bst.input_info(sname);
+        job->entry.inputs.emplace_back(std::move(sname), fi);
+    }
+    return job;
+}
+
+/* runs the deferred steps of an outdated job, unless its output can be
+ * restored from the artifact cache
+ */
+static void job_run(obuild::build_state &bst, obuild::build_job &job) {
+    std::uint64_t key = bst.cache ? bst.cache->key(job) : 0;
+    if (!key) {
+        job.run_steps();
+        return;
+    }
+    obuild::deps_log::dep_list dl;
+    if (!bst.cache->restore(key, job.target(), dl)) {
+        job.cache_key = key;
+        job.run_steps();
+        return;
+    }
+    /* only print */
+    job.run_steps(false);
+    if (job.depfile.empty()) {
+        return;
+    }
+    /* the depfile was not written, use what the entry was built with */
+    for (auto &dep: dl) {
+        dep.second = bst.input_info(dep.first);
+    }
+    job.entry.ndeps = std::int64_t(dl.size());
+    bst.deps.record(job.target(), dl);
+    job.depfile.clear();
+}
+
+/* no-ops unless --trace was given */
+static std::int64_t trace_now(obuild::build_state &bst) {
+    return bst.trace ? bst.trace->now() : 0;
+}
+
+static void trace_add(
+    obuild::build_state &bst, std::string_view cat, std::string_view name,
+    std::int64_t start, std::string_view target, int status = 0
+) {
+    if (bst.trace) {
+        bst.trace->add(cat, name, start, target, status);
+    }
+}
+
+/* for rule bodies, which interleave on the main thread */
+static void trace_span(
+    obuild::build_state &bst, std::string_view cat, std::string_view name,
+    std::int64_t start, int status = 0
+) {
+    if (bst.trace) {
+        bst.trace->add_async(cat, name, start, name, status);
+    }
+}
+
+/* cubescript threads for rule bodies are reused, as creating them is a
+ * visible part of evaluating small bodies; must not outlive the state
+ */
+struct body_pool {
+    struct thread {
+        thread(cs::state &cs): ts{cs.new_thread()} {}
+
+        cs::state ts;
+        /* keeps its capacity from body to body */
+        std::string sources;
+    };
+
+    body_pool(cs::state &cs):
+        target{cs.new_ident("target")}, source{cs.new_ident("source")},
+        sources{cs.new_ident("sources")}, p_cs{cs}
+    {}
+
+    /* bodies may nest, e.g. through invoke */
+    std::unique_ptr<thread> take() {
+        if (p_free.empty()) {
+            return std::make_unique<thread>(p_cs);
+        }
+        auto ret = std::move(p_free.back());
+        p_free.pop_back();
+        return ret;
+    }
+
+    void put(std::unique_ptr<thread> th) {
+        p_free.push_back(std::move(th));
+    }
+
+    /* the variables bound for bodies, rather than looked up every time */
+    cs::ident &target;
+    cs::ident &source;
+    cs::ident &sources;
+
+private:
+    cs::state &p_cs;
+    std::vector<std::unique_ptr<thread>> p_free;
+};
 
-            cs::any_value idv{};
-            idv.set_string(tgt, ts);
-            target.set(std::move(idv));
+/* with a job, the body's commands get deferred into it */
+static void body_call(
+    body_pool &pool, obuild::build_state &bst, cs::bcode_ref const &body,
+    std::string_view tgt, std::vector<std::string_view> const &srcs,
+    std::shared_ptr<obuild::build_job> const &job
+) {
+    auto th = pool.take();
+    auto &ts = th->ts;
+    {
+        cs::alias_local target{ts, pool.target};
+        cs::alias_local source{ts, pool.source};
+        cs::alias_local sources{ts, pool.sources};
 
-            if (!srcs.empty()) {
+        cs::any_value idv{};
+        idv.set_string(tgt, ts);
+        target.set(std::move(idv));
 
-                idv.set_string(srcs[0], ts);
-                source.set(std::move(idv));
+        if (srcs.size() == 1) {
+            /* the common case, the string is shared rather than copied */
+            idv.set_string(srcs[0], ts);
+            sources.set(idv);
+            source.set(std::move(idv));
+        } else if (!srcs.empty()) {
+            idv.set_string(srcs[0], ts);
+            source.set(std::move(idv));
 
-                auto dsv = ostd::appender<std::string>();
-                ostd::format(dsv, "%(%s %)", srcs);
-                idv.set_string(dsv.get(), cs);
-                sources.set(std::move(idv));
+            auto &dsv = th->sources;
+            dsv.clear();
+            for (auto src: srcs) {
+                if (!dsv.empty()) {
+                    dsv += ' ';
+                }
+                dsv += src;
             }
+            idv.set_string(dsv, ts);
+            sources.set(std::move(idv));
+        }
+
+        if (job) {
+            bst.attach(&ts, job);
+        }
+        /* the thread is dropped rather than reused after an error */
+        try {
+            body.call(ts);
+        } catch (cs::error const &e) {
+            if (job) {
+                bst.detach(&ts);
+            }
+            throw build::make_error{e.what()};
+        } catch (...) {
+            /* e.g. a make_error thrown by one of our commands */
+            if (job) {
+                bst.detach(&ts);
+            }
+            throw;
+        }
+        if (job) {
+            bst.detach(&ts);
+        }
+    }
+    pool.put(std::move(th));
+}
+
+/* rules are handed to build::make once the whole graph is known, so that
+ * the dependencies on the critical path can be registered (and thus
+ * started) first
+ */
+struct rule_def {
+    std::string target;
+    std::vector<std::string> deps;
+    build::make_rule::body_func body;
+};
+
+using rule_defs = std::vector<rule_def>;
+
+static void rules_commit(
+    build::make &mk, obuild::build_state &bst, rule_defs &defs
+) {
+    for (auto &def: defs) {
+        std::vector<std::pair<std::int64_t, std::string const *>> order;
+        for (auto &dep: def.deps) {
+            order.emplace_back(bst.critical_path(dep), &dep);
+        }
+        std::stable_sort(order.begin(), order.end(), [](
+            auto const &a, auto const &b
+        ) {
+            return a.first > b.first;
+        });
+        /* build::make always runs the body, obuild decides what is stale */
+        auto &r = mk.rule(def.target).action(true).body(def.body);
+        for (auto &p: order) {
+            r.depend(std::string_view{*p.second});
+        }
+    }
+    defs.clear();
+}
+
+/* given as the optional last argument of rule */
+struct rule_flags {
+    /* the body produces all of the targets at once */
+    bool group = false;
+    /* dependents only rebuild if the contents of the output changed */
+    bool restat = false;
+};
 
+static void rule_add(
+    cs::state &cs, rule_defs &defs, body_pool &pool, obuild::build_state &bst,
+    std::string_view target, std::string_view depends,
+    cs::bcode_ref body, bool action = false, rule_flags flags = {}
+) {
+    build::make_rule::body_func bodyf{};
+    obuild::body_hash hashf{};
+    if (!body.empty()) {
+        bodyf = [body, action, &pool, &bst](auto rtgt, auto srcs) {
+            std::string_view tgt{rtgt};
+            /* build::make gets the dependencies in scheduling order, the
+             * sources are in the order they were written
+             */
+            static_cast<void>(srcs);
+            auto nd = bst.graph.resolve(std::string{tgt});
+            std::vector<std::string_view> svs(nd.deps.begin(), nd.deps.end());
+            auto tstart = trace_now(bst);
+            /* actions are not logged, they always run */
+            if (action) {
+                body_call(pool, bst, body, tgt, svs, nullptr);
+                trace_span(bst, "action", tgt, tstart);
+                return;
+            }
+            auto job = job_new(bst, tgt, svs);
+            if (!nd.group.empty()) {
+                /* the artifact cache holds a single output per entry */
+                job->outputs = std::move(nd.group);
+                job->cacheable = false;
+            }
             try {
-                body.call(ts);
-            } catch (cs::error const &e) {
-                throw build::make_error{e.what()};
+                body_call(pool, bst, body, tgt, svs, job);
+                if (bst.outdated(*job)) {
+                    job_run(bst, *job);
+                } else if (bst.log.find(job->target())) {
+                    /* nothing new to log */
+                    job->discard();
+                }
+            } catch (...) {
+                job->discard();
+                job->release();
+                trace_span(bst, "rule", tgt, tstart, 1);
+                throw;
             }
+            job->release();
+            trace_span(bst, "rule", tgt, tstart);
+        };
+        hashf = [body, &pool, &bst](auto &tgt, auto &srcs) {
+            std::vector<std::string_view> svs(srcs.begin(), srcs.end());
+            auto job = std::make_shared<obuild::build_job>(bst, tgt);
+            job->discard();
+            body_call(pool, bst, body, tgt, svs, job);
+            return job->entry.cmd_hash;
         };
     }
+    std::vector<std::string> deps;
+    cs::list_parser lp{cs, depends};
+    while (lp.parse()) {
+        deps.emplace_back(std::string_view{lp.get_item()});
+    }
+    std::vector<std::string> tnames;
     cs::list_parser p{cs, target};
     while (p.parse()) {
-        cs::list_parser lp{cs, depends};
-        auto &r = mk.rule(
-            std::string_view{p.get_item()}
-        ).action(action).body(bodyf);
-        while (lp.parse()) {
-            r.depend(std::string_view{lp.get_item()});
+        tnames.emplace_back(std::string_view{p.get_item()});
+    }
+    if (!flags.group || (tnames.size() < 2)) {
+        for (auto &tname: tnames) {
+            defs.push_back(rule_def{tname, deps, bodyf});
+            bst.graph.add(tname, deps, hashf, action, flags.restat);
         }
+        return;
     }
+    /* the body runs for the first target only, the others depend on it
+     * and are logged along with it
+     */
+    for (auto &tname: tnames) {
+        if (tname.find('%') != tname.npos) {
+            throw build::make_error{
+                "grouped pattern rules are not supported"
+            };
+        }
+    }
+    auto &primary = tnames.front();
+    defs.push_back(rule_def{primary, deps, bodyf});
+    bst.graph.add(primary, std::move(deps), hashf, action, flags.restat);
+    std::vector<std::string> others(tnames.begin() + 1, tnames.end());
+    for (auto &out: others) {
+        defs.push_back(rule_def{out, {primary}, {}});
+        bst.graph.add(out, {primary}, {}, action, flags.restat);
+    }
+    bst.graph.add_group(primary, std::move(others));
 }
 
-static void init_rulelib(cs::state &s, build::make &mk) {
-    s.new_command("rule", "ssb", [&mk](auto &css, auto args, auto &) {
+/* discovered dependencies behave like depend lines for ordering, but
+ * only the ones built by rules are added, so that a removed header does
+ * not fail the build; they are kept out of the sources via a phony target
+ */
+static void implicit_add(build::make &mk, obuild::build_state &bst) {
+    for (auto &p: bst.implicit_deps()) {
+        std::string phony{obuild::IMPLICIT_PREFIX};
+        phony += p.first;
+        auto &r = mk.rule(phony).action(true);
+        for (auto &dep: p.second) {
+            r.depend(std::string_view{dep});
+        }
+        mk.rule(p.first).action(true).depend(std::string_view{phony});
+    }
+}
+
+/* order-only dependencies get the same treatment, they are built before
+ * the target but its body never sees them
+ */
+static void order_add(build::make &mk, obuild::build_state &bst) {
+    bst.graph.each_order([&mk](
+        std::string const &target, std::vector<std::string> const &deps
+    ) {
+        std::string phony{obuild::ORDER_PREFIX};
+        phony += target;
+        auto &r = mk.rule(phony).action(true);
+        for (auto &dep: deps) {
+            r.depend(std::string_view{dep});
+        }
+        mk.rule(target).action(true).depend(std::string_view{phony});
+    });
+}
+
+static void init_rulelib(
+    cs::state &s, rule_defs &defs, body_pool &pool, obuild::build_state &bst
+) {
+    s.new_command("rule", "ssbs", [&defs, &pool, &bst](
+        auto &css, auto args, auto &
+    ) {
+        rule_flags flags;
+        cs::list_parser p{css, args[3].get_string(css)};
+        while (p.parse()) {
+            std::string flag{std::string_view{p.get_item()}};
+            if (flag == "group") {
+                flags.group = true;
+            } else if (flag == "restat") {
+                flags.restat = true;
+            } else {
+                throw build::make_error{"unknown rule flag '%s'", flag};
+            }
+        }
         rule_add(
-            css, mk, args[0].get_string(css),
-            args[1].get_string(css), args[2].get_code()
+            css, defs, pool, bst, args[0].get_string(css),
+            args[1].get_string(css), args[2].get_code(), false, flags
         );
     });
 
-    s.new_command("action", "sb", [&mk](auto &css, auto args, auto &) {
+    s.new_command("action", "sb", [&defs, &pool, &bst](
+        auto &css, auto args, auto &
+    ) {
         rule_add(
-            css, mk, args[0].get_string(css), std::string_view{},
+            css, defs, pool, bst, args[0].get_string(css), std::string_view{},
             args[1].get_code(), true
         );
     });
 
-    s.new_command("depend", "ss", [&mk](auto &css, auto args, auto &) {
+    s.new_command("depend", "ss", [&defs, &pool, &bst](
+        auto &css, auto args, auto &
+    ) {
         rule_add(
-            css, mk, args[0].get_string(css), args[1].get_string(css),
-            cs::bcode_ref{}
+            css, defs, pool, bst, args[0].get_string(css),
+            args[1].get_string(css), cs::bcode_ref{}
         );
     });
+
+    s.new_command("order_depend", "ss", [&bst](
+        auto &css, auto args, auto &
+    ) {
+        std::vector<std::string> deps;
+        cs::list_parser lp{css, args[1].get_string(css)};
+        while (lp.parse()) {
+            deps.emplace_back(std::string_view{lp.get_item()});
+        }
+        cs::list_parser p{css, args[0].get_string(css)};
+        while (p.parse()) {
+            std::string tname{std::string_view{p.get_item()}};
+            if (tname.find('%') != tname.npos) {
+                throw build::make_error{
+                    "order-only dependencies of pattern rules are "
+                    "not supported"
+                };
+            }
+            bst.graph.add_order(tname, deps);
+        }
+    });
+
+    /* only meaningful in the body of a non-action rule */
+    s.new_command("depfile", "s", [&bst](auto &css, auto args, auto &) {
+        if (auto job = bst.current(&css); job) {
+            job->depfile = std::string_view{args[0].get_string(css)};
+        }
+    });
+
+    s.new_command("pool", "si", [&bst](auto &css, auto args, auto &) {
+        std::string name{std::string_view{args[0].get_string(css)}};
+        auto depth = args[1].get_integer();
+        if (depth < 1) {
+            throw build::make_error{
+                "pool '%s' needs a depth of at least 1", name
+            };
+        }
+        auto &p = bst.pools[name];
+        if (p) {
+            p->set_depth(int(depth));
+        } else {
+            p = std::make_unique<obuild::job_pool>(int(depth));
+        }
+    });
+
+    /* the commands of the current rule body run in the pool */
+    s.new_command("usepool", "s", [&bst](auto &css, auto args, auto &) {
+        std::string name{std::string_view{args[0].get_string(css)}};
+        auto it = bst.pools.find(name);
+        if (it == bst.pools.end()) {
+            throw build::make_error{"unknown pool '%s'", name};
+        }
+        auto job = bst.current(&css);
+        if (!job) {
+            /* actions are not jobs, their commands run right away */
+            throw build::make_error{
+                "usepool can only be used in the body of a file rule"
+            };
+        }
+        job->pool = it->second.get();
+    });
 }
 
-static void init_baselib(cs::state &s, build::make &mk, bool ignore_env) {
-    s.new_command("echo", "...", [](auto &css, auto args, auto &) {
-        ostd::writeln(cs::concat_values(css, args, " ").view());
+/* lets build::make run the other rule bodies until it gets back to this
+ * one, like while it waits for a task
+ */
+static void body_yield() {
+    auto *ctx = ostd::coroutine_context::current();
+    if (!ctx) {
+        throw build::make_error{"cannot wait outside of a rule body"};
+    }
+    auto &cc = static_cast<ostd::coroutine<void()> &>(*ctx);
+    ostd::coroutine<void()>::yield_type{cc}();
+}
+
+static void shell_push(
+    build::make &mk, obuild::build_state &bst, std::string ds,
+    std::shared_ptr<obuild::build_job> job
+) {
+    /* a pooled command is held back until the pool has room rather than
+     * waiting in a worker; the body is parked meanwhile, and is handed
+     * the slot by the release that frees it
+     */
+    auto *pool = job ? job->pool : nullptr;
+    if (std::size_t ticket; pool && !pool->try_acquire(ticket)) {
+        try {
+            do {
+                body_yield();
+            } while (!pool->granted(ticket));
+        } catch (...) {
+            /* the build is being torn down */
+            pool->cancel(ticket);
+            throw;
+        }
+    }
+    if (job) {
+        job->hold();
+    }
+    mk.push_task([&bst, ds = std::move(ds), job = std::move(job), pool]() {
+        if (job) {
+            job->task_started();
+        }
+        /* no token is held while waiting for the host */
+        if (bst.throttle) {
+            bst.throttle->start();
+        }
+        if (bst.tokens) {
+            bst.tokens->acquire();
+        }
+        auto tstart = trace_now(bst);
+        int ret = obuild::run_command(ds);
+        if (bst.tokens) {
+            bst.tokens->release();
+        }
+        if (pool) {
+            pool->release();
+        }
+        if (bst.throttle) {
+            bst.throttle->finish();
+        }
+        trace_add(
+            bst, "shell", ds, tstart,
+            job ? std::string_view{job->target()} : std::string_view{}, ret
+        );
+        if (ret) {
+            if (job) {
+                job->discard();
+                job->release();
+            }
+            throw build::make_error{""};
+        }
+        if (job) {
+            job->release();
+        }
+    });
+}
+
+static bool do_run_file(
+    cs::state &s, obuild::build_state &bst, std::string_view fname
+);
+
+static void init_baselib(
+    cs::state &s, build::make &mk, rule_defs &defs, obuild::build_state &bst,
+    bool ignore_env
+) {
+    s.new_command("echo", "...", [&bst](auto &css, auto args, auto &) {
+        std::string ds{cs::concat_values(css, args, " ").view()};
+        if (auto job = bst.current(&css); job) {
+            job->defer([ds = std::move(ds)]() {
+                ostd::writeln(ds);
+            });
+            return;
+        }
+        bst.config.add_output(ds);
+        ostd::writeln(ds);
     });
 
-    s.new_command("shell", "...", [&mk](auto &css, auto args, auto &) {
-        mk.push_task([
-            ds = std::string{cs::concat_values(css, args, " ").view()}
-        ]() {
-            if (system(ds.data())) {
-                throw build::make_error{""};
+    s.new_command("shell", "...", [&mk, &bst](auto &css, auto args, auto &) {
+        std::string ds{cs::concat_values(css, args, " ").view()};
+        auto job = bst.current(&css);
+        if (!job) {
+            if (bst.config.evaluating()) {
+                bst.config.uncacheable();
             }
-        });
+            shell_push(mk, bst, std::move(ds), nullptr);
+            return;
+        }
+        job->add_command(ds);
+        job->defer([&mk, &bst, ds = std::move(ds), job = job.get()]() {
+            shell_push(mk, bst, ds, job->shared_from_this());
+        }, true);
     });
 
-    s.new_command("getenv", "ss", [ignore_env](auto &css, auto args, auto &res) {
+    s.new_command("getenv", "ss", [&bst, ignore_env](
+        auto &css, auto args, auto &res
+    ) {
         if (ignore_env) {
             res.set_string("", css);
             return;
         }
-        res.set_string(ostd::env_get(
-            std::string_view{args[0].get_string(css)}
-        ).value_or(
+        std::string name{std::string_view{args[0].get_string(css)}};
+        auto val = ostd::env_get(name);
+        bst.config.add_env(name, val);
+        res.set_string(val.value_or(
             std::string{std::string_view{args[1].get_string(css)}}
         ), css);
     });
 
-    s.new_command("invoke", "s", [&mk](auto &css, auto args, auto &) {
-        mk.exec(std::string_view{args[0].get_string(css)});
+    s.new_command("invoke", "s", [&mk, &defs, &bst](
+        auto &css, auto args, auto &
+    ) {
+        std::string tgt{std::string_view{args[0].get_string(css)}};
+        if (auto job = bst.current(&css); job) {
+            job->add_command("invoke " + tgt);
+            /* the effects are not confined to the output */
+            job->cacheable = false;
+            job->defer([&mk, tgt = std::move(tgt)]() {
+                mk.exec(tgt);
+            }, true);
+            return;
+        }
+        if (bst.config.evaluating()) {
+            bst.config.uncacheable();
+        }
+        /* the rules defined so far have to be known to build::make */
+        rules_commit(mk, bst, defs);
+        mk.exec(tgt);
+    });
+
+    s.new_command("include", "s", [&bst](auto &css, auto args, auto &) {
+        std::string_view fname{args[0].get_string(css)};
+        if (!do_run_file(css, bst, fname)) {
+            throw build::make_error{"failed including '%s'", fname};
+        }
     });
 }
 
-static void init_pathlib(cs::state &s) {
+static void init_pathlib(cs::state &s, obuild::build_state &bst) {
     s.new_command("extreplace", "sss", [](auto &css, auto args, auto &res) {
         ostd::string_range oldext = std::string_view{args[1].get_string(css)};
         ostd::string_range newext = std::string_view{args[2].get_string(css)};
@@ -139,56 +657,397 @@ static void init_pathlib(cs::state &s) {
         res.set_string(ret, css);
     });
 
-    s.new_command("glob", "...", [](auto &css, auto args, auto &res) {
-        auto app = ostd::appender<std::vector<ostd::path>>();
+    /* the directories read decide whether the rule graph can be reused;
+     * patterns starting with ! exclude paths from all the others
+     */
+    s.new_command("glob", "...", [&bst](auto &css, auto args, auto &res) {
+        std::vector<std::string> pats, excludes;
         cs::list_parser p{css, cs::concat_values(css, args, " ")};
         while (p.parse()) {
-            auto it = p.get_item();
-            fs::glob_match(app, std::string_view{it});
+            auto item = p.get_item();
+            std::string_view it{item};
+            if (!it.empty() && (it[0] == '!')) {
+                excludes.emplace_back(it.substr(1));
+            } else {
+                pats.emplace_back(it);
+            }
         }
-        res.set_string(ostd::format(
-            ostd::appender<std::string>(), "%(%s %)", app.get()
-        ).get(), css);
+        std::string ret;
+        for (auto &pat: pats) {
+            auto &gr = bst.globs.match(pat, excludes);
+            for (auto &d: gr.dirs) {
+                bst.config.add_dir(d.first, d.second);
+            }
+            for (auto &m: gr.matches) {
+                if (!ret.empty()) {
+                    ret += ' ';
+                }
+                ret += m;
+            }
+        }
+        res.set_string(ret, css);
+    });
+
+    /* a hex string, empty if the file cannot be read; the file becomes an
+     * input of the evaluation like an included one
+     */
+    s.new_command("filehash", "s", [&bst](auto &css, auto args, auto &res) {
+        std::string fn{std::string_view{args[0].get_string(css)}};
+        auto fi = obuild::stat_file(fn);
+        auto h = obuild::hash_file(fn, bst.hashes->threads);
+        if (bst.config.evaluating()) {
+            bst.config.add_file(fn, fi, h);
+        }
+        if (!h) {
+            res.set_string("", css);
+            return;
+        }
+        char buf[17];
+        std::snprintf(
+            buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(h)
+        );
+        res.set_string(std::string_view{buf}, css);
     });
 }
 
-static bool do_run_file(cs::state &s, std::string_view fname) {
-    ostd::file_stream f{fname};
-    if (!f.is_open()) {
+static bool do_run_file(
+    cs::state &s, obuild::build_state &bst, std::string_view fname
+) {
+    /* compiled straight from the mapping, without copying */
+    obuild::file_map f;
+    std::string fn{fname};
+    if (!f.open(fn)) {
         return false;
     }
 
-    f.seek(0, ostd::stream_seek::END);
-    auto len = f.tell();
-    f.seek(0);
+    if (fn == "-") {
+        /* nothing to check the next time */
+        bst.config.uncacheable();
+    } else {
+        bst.config.add_file(fn, f.data());
+    }
+    auto tstart = trace_now(bst);
+    s.compile(f.data(), fname).call(s);
+    trace_add(bst, "config", fn, tstart, std::string_view{});
+    return true;
+}
 
-    auto buf = std::make_unique<char[]>(len + 1);
-    if (!buf) {
-        return false;
+/* an empty message means the error was already reported */
+static void error_print(char const *prog, build::make_error const &e) {
+    auto s = e.what();
+    if (s[0]) {
+        ostd::cerr.writefln("%s: %s", prog, s);
     }
+}
 
-    if (f.read_bytes(buf.get(), len) != std::size_t(len)) {
-        return false;
+static void build_run(
+    build::make &mk, obuild::build_state &bst, std::string const &action
+) {
+    /* nothing changed since the last build, skip the stat walk */
+    if (bst.up_to_date(action)) {
+        return;
     }
+    mk.exec(action);
+    bst.hashes->save();
+    if (bst.cache) {
+        ostd::writefln(
+            "artifact cache: %d hits, %d misses",
+            bst.cache->hits(), bst.cache->misses()
+        );
+    }
+}
 
-    buf[len] = '\0';
+/* quiet time after the last change before rebuilding */
+static constexpr int WATCH_DEBOUNCE_MS = 50;
 
-    s.compile(std::string_view{buf.get(), std::size_t(len)}, fname).call(s);
-    return true;
+/* the files the graph depends on which no rule builds */
+static void watch_graph(obuild::file_watcher &fw, obuild::build_state &bst) {
+    std::unordered_set<std::string> seen;
+    auto add = [&fw, &bst, &seen](std::string const &path) {
+        if (seen.insert(path).second && !bst.graph.resolve(path).body) {
+            fw.add(path);
+        }
+    };
+    bst.graph.each([&bst, &add](
+        std::string const &target, std::vector<std::string> const &,
+        bool, bool, bool
+    ) {
+        /* pattern rules are covered by the targets using them */
+        if (target.find('%') != target.npos) {
+            return;
+        }
+        for (auto &dep: bst.graph.resolve(target).deps) {
+            add(dep);
+        }
+    });
+    bst.deps.each([&add](
+        std::string const &, std::vector<std::string const *> const &deps
+    ) {
+        for (auto *dep: deps) {
+            add(*dep);
+        }
+    });
+}
+
+/* what the evaluation of the build scripts depended on, true for the
+ * directories read by glob
+ */
+using watch_config = std::unordered_map<std::string, bool>;
+
+/* watches everything the graph and the evaluation of the build scripts
+ * depended on, collecting the latter; done again after every build, as
+ * the discovered dependencies change, with the watcher kept so that no
+ * change made during a build is lost
+ */
+static void watch_setup(
+    obuild::file_watcher &fw, obuild::build_state &bst, watch_config &config
+) {
+    if ((fw.fd() < 0) && !fw.open()) {
+        throw build::make_error{"failed initializing inotify"};
+    }
+    bst.config.each_input([&fw, &config](std::string const &path, bool dir) {
+        fw.add(path, dir);
+        config.emplace(path, dir);
+    });
+    watch_graph(fw, bst);
+}
+
+/* the first change that calls for starting over, null if none; in the
+ * directories read by glob, only entries changing the outcome of some
+ * pattern count, not e.g. the swap files of editors or build outputs
+ */
+static std::string const *restart_needed(
+    obuild::file_watcher &fw, obuild::build_state &bst, watch_config &config,
+    std::vector<std::string> const &changed
+) {
+    for (auto &path: changed) {
+        auto it = config.find(path);
+        if (it == config.end()) {
+            continue;
+        }
+        if (!it->second) {
+            return &path;
+        }
+        std::vector<std::string> dirs;
+        if (bst.globs.changed(path, dirs)) {
+            return &path;
+        }
+        /* newly created directories a recursive pattern looks into */
+        for (auto &dir: dirs) {
+            if (config.emplace(dir, true).second) {
+                fw.add(dir, true);
+            }
+        }
+    }
+    return nullptr;
+}
+
+/* whether anything but the directories read by glob changed */
+static bool graph_changed(
+    watch_config const &config, std::vector<std::string> const &changed
+) {
+    return std::any_of(changed.begin(), changed.end(), [&config](
+        auto const &path
+    ) {
+        auto it = config.find(path);
+        return (it == config.end()) || !it->second;
+    });
+}
+
+/* the rules cannot be taken back from build::make, so changes to the
+ * build scripts are dealt with by starting over
+ */
+[[noreturn]] static void restart(
+    obuild::build_state &bst, std::string const &path,
+    std::string const &startdir, char **argv
+) {
+    ostd::writefln("%s changed, restarting", path);
+    /* the new image exports a jobserver of its own */
+    if (bst.tokens) {
+        bst.tokens->unexport();
+    }
+    fs::current_path(startdir);
+    execv("/proc/self/exe", argv);
+    execvp(argv[0], argv);
+    throw build::make_error{"failed restarting"};
+}
+
+/* rebuilds whenever something the graph depends on changes, with the
+ * graph and the stat cache kept; changes to what the evaluation of the
+ * build scripts depended on restart the process instead
+ */
+[[noreturn]] static void watch_loop(
+    build::make &mk, obuild::build_state &bst, std::string const &action,
+    std::string const &startdir, char **argv
+) {
+    obuild::file_watcher fw;
+    watch_config config;
+    /* from before the first build on */
+    watch_setup(fw, bst, config);
+    bool built = true;
+    for (;;) {
+        if (built) {
+            try {
+                build_run(mk, bst, action);
+            } catch (build::make_error const &e) {
+                error_print(argv[0], e);
+            }
+            /* we never get to exit normally */
+            if (bst.trace) {
+                bst.trace->write();
+            }
+            watch_setup(fw, bst, config);
+            ostd::writeln("watching for changes...");
+        }
+        /* including whatever changed while building */
+        std::vector<std::string> changed;
+        if (!fw.wait(changed, WATCH_DEBOUNCE_MS)) {
+            throw build::make_error{"failed watching for changes"};
+        }
+        if (auto *path = restart_needed(fw, bst, config, changed); path) {
+            restart(bst, *path, startdir, argv);
+        }
+        bst.files_changed(changed);
+        built = graph_changed(config, changed);
+    }
+}
+
+/* runs a build for a client, with our output going to the client's */
+static int server_build(
+    build::make &mk, obuild::build_state &bst,
+    obuild::server_request const &req, char const *prog
+) {
+    std::fflush(nullptr);
+    int out = dup(STDOUT_FILENO), err = dup(STDERR_FILENO);
+    dup2(req.out, STDOUT_FILENO);
+    dup2(req.err, STDERR_FILENO);
+    int ret = 0;
+    /* like when reusing the cached graph */
+    for (auto &line: bst.config.output()) {
+        ostd::writeln(line);
+    }
+    try {
+        build_run(mk, bst, req.action);
+    } catch (build::make_error const &e) {
+        error_print(prog, e);
+        ret = 1;
+    }
+    std::fflush(nullptr);
+    dup2(out, STDOUT_FILENO);
+    dup2(err, STDERR_FILENO);
+    close(out);
+    close(err);
+    return ret;
+}
+
+/* keeps the graph, the stat cache and the interpreter for the builds
+ * requested by clients in the directory, one at a time; what changed in
+ * between is known through inotify
+ */
+[[noreturn]] static void server_loop(
+    build::make &mk, obuild::build_state &bst, std::uint64_t key,
+    std::uint64_t env, std::string const &startdir, char **argv
+) {
+    obuild::build_server srv;
+    if (!srv.listen()) {
+        throw build::make_error{
+            "failed listening on %s, is a server running already?",
+            obuild::SERVER_SOCKET_NAME
+        };
+    }
+    /* nested invocations in the directory must not wait for us */
+    setenv("OBUILD_SERVER", "1", 1);
+    ostd::writefln("serving builds on %s", obuild::SERVER_SOCKET_NAME);
+    /* kept for the lifetime of the server, so that the changes made
+     * during a build are known to the next one
+     */
+    obuild::file_watcher fw;
+    watch_config config;
+    watch_setup(fw, bst, config);
+    std::vector<std::string> changed;
+    for (;;) {
+        std::unique_ptr<obuild::server_request> req;
+        while (!req) {
+            pollfd pfds[2] = {{srv.fd(), POLLIN, 0}, {fw.fd(), POLLIN, 0}};
+            if ((poll(pfds, 2, -1) < 0) && (errno != EINTR)) {
+                throw build::make_error{"failed waiting for clients"};
+            }
+            if (!fw.take(changed)) {
+                throw build::make_error{"failed watching for changes"};
+            }
+            if (auto *path = restart_needed(fw, bst, config, changed); path) {
+                srv.close();
+                restart(bst, *path, startdir, argv);
+            }
+            if (!(pfds[0].revents & POLLIN)) {
+                continue;
+            }
+            req = std::make_unique<obuild::server_request>();
+            if (!srv.accept(*req)) {
+                req.reset();
+            } else if ((req->key != key) || (req->env != env)) {
+                /* the client has to build with its own settings */
+                req->reject();
+                req.reset();
+            }
+        }
+        /* whatever is still pending, e.g. edits right before the request */
+        if (!fw.take(changed)) {
+            throw build::make_error{"failed watching for changes"};
+        }
+        if (auto *path = restart_needed(fw, bst, config, changed); path) {
+            /* the client builds on its own meanwhile */
+            req->reject();
+            srv.close();
+            restart(bst, *path, startdir, argv);
+        }
+        bst.files_changed(changed);
+        changed.clear();
+        req->finish(server_build(mk, bst, *req, argv[0]));
+        /* we never get to exit normally */
+        if (bst.trace) {
+            bst.trace->write();
+        }
+        /* the discovered dependencies may have changed */
+        watch_setup(fw, bst, config);
+    }
+}
+
+/* a limit of the throttle, 0 if not given */
+static double limit_parse(std::string_view opt, std::string const &val) {
+    if (val.empty()) {
+        return 0;
+    }
+    char *end = nullptr;
+    double ret = std::strtod(val.data(), &end);
+    if ((end == val.data()) || *end || !std::isfinite(ret) || (ret < 0)) {
+        throw build::make_error{"invalid value for %s: '%s'", opt, val};
+    }
+    return ret;
 }
 
 void do_main(int argc, char **argv) {
-    /* cubescript interpreter */
+    /* before we change it ourselves */
+    auto env = obuild::env_hash();
+
+    /* cubescript interpreter, initialized once we know we need it */
     cs::state s;
-    cs::std_init_all(s);
 
     /* arg values */
     std::string action  = "default";
     std::string deffile = "obuild.cfg";
     std::string curdir;
     std::string fcont;
+    std::string cachedir;
+    std::string tracefile;
+    std::string maxload;
+    std::string maxpressure;
     bool ignore_env = false;
-    int jobs = 1;
+    bool watch = false;
+    bool server = false;
+    bool hash_inputs = false;
+    /* -1 if not given */
+    int jobs = -1;
 
     /* input options */
     {
@@ -202,13 +1061,24 @@ void do_main(int argc, char **argv) {
             .help("specify the number of jobs to use (default: 1)")
             .action(ostd::arg_store_format("%d", jobs));
 
+        ap.add_optional("-l", "--max-load", 1)
+            .help("start no commands while the load average is at least N")
+            .metavar("N")
+            .action(ostd::arg_store_str(maxload));
+
+        ap.add_optional("-P", "--max-pressure", 1)
+            .help("start no commands while CPU or memory pressure is at "
+                  "least PERCENT (Linux)")
+            .metavar("PERCENT")
+            .action(ostd::arg_store_str(maxpressure));
+
         ap.add_optional("-C", "--change-directory", 1)
             .help("change to DIRECTORY before running")
             .metavar("DIRECTORY")
             .action(ostd::arg_store_str(curdir));
 
         ap.add_optional("-f", "--file", 1)
-            .help("specify the file to run (default: obuild.cfg)")
+            .help("specify the file to run (default: obuild.cfg, - for stdin)")
             .action(ostd::arg_store_str(deffile));
 
         ap.add_optional("-e", "--execute", 1)
@@ -220,6 +1090,29 @@ void do_main(int argc, char **argv) {
             .help("ignore environment variables")
             .action(ostd::arg_store_true(ignore_env));
 
+        ap.add_optional("-w", "--watch", 0)
+            .help("keep rebuilding the action whenever its inputs change")
+            .action(ostd::arg_store_true(watch));
+
+        ap.add_optional("-s", "--server", 0)
+            .help("keep serving the builds of clients in the directory")
+            .action(ostd::arg_store_true(server));
+
+        ap.add_optional("-H", "--hash-inputs", 0)
+            .help("rebuild when the contents of inputs change, not their "
+                  "timestamps")
+            .action(ostd::arg_store_true(hash_inputs));
+
+        ap.add_optional("-c", "--cache", 1)
+            .help("restore rule outputs from and store them in DIRECTORY")
+            .metavar("DIRECTORY")
+            .action(ostd::arg_store_str(cachedir));
+
+        ap.add_optional("-t", "--trace", 1)
+            .help("write a timeline of the build to FILE (Chrome trace format)")
+            .metavar("FILE")
+            .action(ostd::arg_store_str(tracefile));
+
         ap.add_positional("action", ostd::arg_value::OPTIONAL)
             .help("the action to perform")
             .action(ostd::arg_store_str(action));
@@ -237,14 +1130,45 @@ void do_main(int argc, char **argv) {
         }
     }
 
+    double max_load = limit_parse("--max-load", maxload);
+    double max_pressure = limit_parse("--max-pressure", maxpressure);
+
     int ncpus = std::thread::hardware_concurrency();
-    jobs = std::max(1, jobs ? jobs : ncpus);
+    /* under a jobserver, its tokens limit the jobs unless -j was given;
+     * otherwise we are the jobserver for the commands we run
+     */
+    auto tokens = std::make_unique<obuild::jobserver>();
+    bool joined = false;
+    if ((jobs < 0) && tokens->join()) {
+        jobs = ncpus;
+        joined = true;
+    } else {
+        jobs = std::max(1, (jobs < 0) ? 1 : (jobs ? jobs : ncpus));
+        if ((jobs == 1) || !tokens->create(jobs)) {
+            tokens.reset();
+        }
+    }
 
     /* core cubescript variables */
     s.new_var("numcpus", ncpus, true);
     s.new_var("numjobs", jobs, true);
 
+    if ((watch || server) && (deffile == "-")) {
+        throw build::make_error{"cannot watch a build script read from stdin"};
+    }
+    if (watch && server) {
+        throw build::make_error{"cannot watch and serve at the same time"};
+    }
+#ifndef OSTD_PLATFORM_LINUX
+    if (watch || server) {
+        throw build::make_error{
+            "%s needs inotify, which is Linux only", watch ? "-w" : "-s"
+        };
+    }
+#endif
+
     /* switch to target directory */
+    std::string startdir = fs::current_path().string();
     try {
         if (!curdir.empty()) {
             fs::current_path(curdir);
@@ -255,33 +1179,128 @@ void do_main(int argc, char **argv) {
         };
     }
 
+    /* whatever the evaluation of the build scripts depends on */
+    auto opts = obuild::hash_string(deffile);
+    opts = obuild::hash_string(fcont, opts);
+    opts = obuild::hash_string(ostd::format(
+        ostd::appender<std::string>(), "%d %d %d", int(ignore_env), jobs, ncpus
+    ).get(), opts);
+
+    /* a server only takes builds it would do the same way; the tokens of
+     * a parent jobserver cannot be handed to it
+     */
+    auto skey = obuild::hash_string(ostd::format(
+        ostd::appender<std::string>(), "%s\n%s\n%s\n%d", cachedir, maxload,
+        maxpressure, int(hash_inputs)
+    ).get(), opts);
+    if (
+        !server && !watch && tracefile.empty() && !joined &&
+        !std::getenv("OBUILD_SERVER")
+    ) {
+        int ret = obuild::server_forward(skey, env, action);
+        if (ret > 0) {
+            /* reported by the server */
+            throw build::make_error{""};
+        } else if (!ret) {
+            return;
+        }
+    }
+    cs::std_init_all(s);
+
+    /* persistent state of the build directory; without a writable log
+     * the build still works, it just has no memory of previous runs
+     */
+    obuild::build_state bst;
+    bst.log.open(obuild::BUILD_LOG_NAME);
+    bst.deps.open(obuild::DEPS_LOG_NAME);
+    bst.globs.open(obuild::GLOB_CACHE_NAME);
+    bst.globs.threads = jobs;
+    /* also needed for the outputs of restat rules, it is only read
+     * from disk once there is something to hash
+     */
+    bst.hashes = std::make_unique<obuild::hash_cache>();
+    bst.hashes->open(obuild::HASH_CACHE_NAME);
+    bst.hashes->threads = jobs;
+    bst.hash_inputs = hash_inputs;
+    if (!cachedir.empty()) {
+        bst.cache = std::make_unique<obuild::artifact_cache>(cachedir);
+    }
+    if (!tracefile.empty()) {
+        bst.trace = std::make_unique<obuild::build_trace>(tracefile);
+    }
+    bst.tokens = std::move(tokens);
+    if ((max_load > 0) || (max_pressure > 0)) {
+        bst.throttle = std::make_unique<obuild::load_throttle>(
+            max_load, max_pressure
+        );
+    }
+
     /* init buildsystem, use coroutine tasks */
     build::make mk{build::make_task_coroutine, jobs};
 
     /* octabuild cubescript libs */
-    init_rulelib(s, mk);
-    init_baselib(s, mk, ignore_env);
-    init_pathlib(s);
+    rule_defs defs;
+    body_pool pool{s};
+    init_rulelib(s, defs, pool, bst);
+    init_baselib(s, mk, defs, bst, ignore_env);
+    init_pathlib(s, bst);
+
+    /* reuse the rule graph of the last run if none of its inputs changed;
+     * the commands of the rules cannot have changed then either, so that
+     * the null build check can use the ones in the log
+     */
+    std::vector<std::string> output;
+    /* watching and serving need the rules registered */
+    if (!watch && !server && bst.config.load(
+        obuild::GRAPH_CACHE_NAME, opts, bst.graph,
+        [&bst](auto &tgt, auto &) -> std::uint64_t {
+            auto ent = bst.log.find(tgt);
+            return ent ? ent->cmd_hash : 0;
+        }, output
+    )) {
+        bst.implicit_deps();
+        if (bst.up_to_date(action)) {
+            for (auto &line: output) {
+                ostd::writeln(line);
+            }
+            return;
+        }
+        bst.reset_graph();
+    }
 
     /* parse rules */
+    bst.config.begin();
     if ((
         !fcont.empty() && !s.compile(fcont).call(s).get_bool()
-    ) || !do_run_file(s, deffile)) {
+    ) || !do_run_file(s, bst, deffile)) {
         throw build::make_error{"failed creating rules"};
     }
+    bst.config.end();
+    bst.globs.save();
+    auto tstart = trace_now(bst);
+    implicit_add(mk, bst);
+    order_add(mk, bst);
+    rules_commit(mk, bst, defs);
+    trace_add(bst, "graph", "commit", tstart, std::string_view{});
 
-    /* make */
-    mk.exec(action);
+    if (server) {
+        bst.config.save(obuild::GRAPH_CACHE_NAME, opts, bst.graph);
+        server_loop(mk, bst, skey, env, startdir, argv);
+    }
+    if (!watch) {
+        build_run(mk, bst, action);
+        bst.config.save(obuild::GRAPH_CACHE_NAME, opts, bst.graph);
+        return;
+    }
+    bst.config.save(obuild::GRAPH_CACHE_NAME, opts, bst.graph);
+    watch_loop(mk, bst, action, startdir, argv);
 }
 
 int main(int argc, char **argv) {
     try {
         do_main(argc, argv);
     } catch (build::make_error const &e) {
-        auto s = e.what();
-        if (s[0]) {
-            ostd::cerr.writefln("%s: %s", argv[0], s);
-        }
+        error_print(argv[0], e);
         return 1;
     }
     return 0;
@@ -0,0 +1,56 @@
+#include "pool.hh"
+
+namespace obuild {
+
+void job_pool::set_depth(int depth) {
+    std::lock_guard<std::mutex> l{p_lock};
+    p_depth = depth;
+    grant();
+}
+
+void job_pool::grant() {
+    while ((p_running < p_depth) && !p_waiting.empty()) {
+        ++p_running;
+        p_granted.insert(p_waiting.front());
+        p_waiting.pop_front();
+    }
+}
+
+bool job_pool::try_acquire(std::size_t &ticket) {
+    std::lock_guard<std::mutex> l{p_lock};
+    if ((p_running < p_depth) && p_waiting.empty()) {
+        ++p_running;
+        return true;
+    }
+    ticket = p_tickets++;
+    p_waiting.push_back(ticket);
+    return false;
+}
+
+bool job_pool::granted(std::size_t ticket) {
+    std::lock_guard<std::mutex> l{p_lock};
+    return p_granted.erase(ticket) != 0;
+}
+
+void job_pool::cancel(std::size_t ticket) {
+    std::lock_guard<std::mutex> l{p_lock};
+    if (p_granted.erase(ticket)) {
+        --p_running;
+        grant();
+        return;
+    }
+    for (auto it = p_waiting.begin(); it != p_waiting.end(); ++it) {
+        if (*it == ticket) {
+            p_waiting.erase(it);
+            return;
+        }
+    }
+}
+
+void job_pool::release() {
+    std::lock_guard<std::mutex> l{p_lock};
+    --p_running;
+    grant();
+}
+
+} /* namespace obuild */
@@ -0,0 +1,50 @@
+#ifndef OBUILD_POOL_HH
+#define OBUILD_POOL_HH
+
+#include <cstddef>
+#include <mutex>
+#include <deque>
+#include <unordered_set>
+
+namespace obuild {
+
+/* limits how many commands of a class of rules (e.g. links) run at once,
+ * on top of the number of jobs; defined with the pool command and used
+ * by rule bodies through usepool
+ *
+ * nothing ever blocks on a pool: a pooled command is only handed to
+ * build::make once it got room, so that it does not hold a worker; the
+ * bodies waiting for room are queued and get it in order
+ */
+struct job_pool {
+    job_pool(int depth): p_depth{depth} {}
+
+    /* thread safe, takes effect for commands started from now on */
+    void set_depth(int depth);
+
+    /* thread safe; takes a slot if there is one nobody is waiting for,
+     * otherwise queues the caller under the returned ticket
+     */
+    bool try_acquire(std::size_t &ticket);
+    /* thread safe; whether the slot was handed to the ticket yet */
+    bool granted(std::size_t ticket);
+    /* thread safe; gives up waiting, or the slot if it came meanwhile */
+    void cancel(std::size_t ticket);
+    /* thread safe; the slot goes to the first one waiting, if any */
+    void release();
+
+private:
+    /* with the lock held */
+    void grant();
+
+    std::mutex p_lock;
+    int p_depth;
+    int p_running = 0;
+    std::size_t p_tickets = 0;
+    std::deque<std::size_t> p_waiting;
+    std::unordered_set<std::size_t> p_granted;
+};
+
+} /* namespace obuild */
+
+#endif
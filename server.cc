@@ -0,0 +1,307 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+
+#include <ostd/platform.hh>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "server.hh"
+#include "state.hh"
+
+extern char **environ;
+
+namespace obuild {
+
+/* the request and the replies, which are a single byte, possibly followed
+ * by the exit status
+ */
+static constexpr char const *PROTOCOL = "obuild server 1";
+static constexpr char REPLY_REJECT = 'R';
+static constexpr char REPLY_DONE = 'D';
+
+/* the largest request, the action being most of it */
+static constexpr std::size_t REQUEST_MAX = 65536;
+
+std::uint64_t env_hash() {
+    std::vector<std::string_view> vars;
+    for (char **e = environ; *e; ++e) {
+        std::string_view var{*e};
+        /* differ between shells without affecting anything; the server
+         * sets OBUILD_SERVER for its commands itself, and inherits it
+         * when it restarts
+         */
+        auto name = var.substr(0, var.find('='));
+        if (
+            (name == "PWD") || (name == "OLDPWD") || (name == "_") ||
+            (name == "OBUILD_SERVER")
+        ) {
+            continue;
+        }
+        vars.push_back(var);
+    }
+    std::sort(vars.begin(), vars.end());
+    std::uint64_t h = 0;
+    for (auto var: vars) {
+        h = hash_string(var, h);
+        h = hash_string(std::string_view{"\n", 1}, h);
+    }
+    return h;
+}
+
+#ifdef OSTD_PLATFORM_LINUX
+static constexpr int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+/* SO_NOSIGPIPE is set on the sockets instead, where there is one */
+static constexpr int SEND_FLAGS = 0;
+
+static int cloexec(int fd) {
+    if (fd >= 0) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    return fd;
+}
+#endif
+
+/* not inherited by the commands we run */
+static int socket_new() {
+#ifdef OSTD_PLATFORM_LINUX
+    return socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+#else
+    int fd = cloexec(socket(AF_UNIX, SOCK_STREAM, 0));
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    if (fd >= 0) {
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+    }
+#endif
+    return fd;
+#endif
+}
+
+static void socket_addr(sockaddr_un &addr) {
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    std::strcpy(addr.sun_path, SERVER_SOCKET_NAME);
+}
+
+static bool read_all(int fd, char *buf, std::size_t n) {
+    while (n) {
+        auto ret = read(fd, buf, n);
+        if ((ret < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (ret <= 0) {
+            return false;
+        }
+        buf += ret;
+        n -= std::size_t(ret);
+    }
+    return true;
+}
+
+/* the client may be gone, which must not kill the server */
+static bool send_all(int fd, char const *buf, std::size_t n) {
+    while (n) {
+        auto ret = send(fd, buf, n, SEND_FLAGS);
+        if ((ret < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (ret <= 0) {
+            return false;
+        }
+        buf += ret;
+        n -= std::size_t(ret);
+    }
+    return true;
+}
+
+int server_forward(
+    std::uint64_t key, std::uint64_t env, std::string const &action
+) {
+    sockaddr_un addr;
+    socket_addr(addr);
+    int fd = socket_new();
+    if (fd < 0) {
+        return -1;
+    }
+    /* no server, or a stale socket */
+    if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr))) {
+        ::close(fd);
+        return -1;
+    }
+    char hdr[64];
+    std::snprintf(
+        hdr, sizeof(hdr), "%s\n%016llx\n%016llx\n", PROTOCOL,
+        static_cast<unsigned long long>(key),
+        static_cast<unsigned long long>(env)
+    );
+    std::string msg = hdr + action;
+    if (msg.size() > REQUEST_MAX) {
+        ::close(fd);
+        return -1;
+    }
+    /* the size first, then the request with our output attached */
+    std::uint32_t size = std::uint32_t(msg.size());
+    int fds[2] = {STDOUT_FILENO, STDERR_FILENO};
+    alignas(cmsghdr) char cbuf[CMSG_SPACE(sizeof(fds))];
+    iovec iov[2] = {
+        {&size, sizeof(size)}, {msg.data(), msg.size()}
+    };
+    msghdr mh{};
+    mh.msg_iov = iov;
+    mh.msg_iovlen = 2;
+    mh.msg_control = cbuf;
+    mh.msg_controllen = sizeof(cbuf);
+    auto *cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    std::memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+    auto len = sizeof(size) + msg.size();
+    if (sendmsg(fd, &mh, SEND_FLAGS) != ssize_t(len)) {
+        ::close(fd);
+        return -1;
+    }
+    /* the build runs now, with its output going straight to ours */
+    char reply[2];
+    int ret = -1;
+    if (read_all(fd, reply, 1) && (reply[0] == REPLY_DONE)) {
+        if (read_all(fd, reply + 1, 1)) {
+            ret = static_cast<unsigned char>(reply[1]);
+        }
+    }
+    ::close(fd);
+    return ret;
+}
+
+server_request::~server_request() {
+    for (int fd: {out, err, conn}) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+}
+
+void server_request::reject() {
+    send_all(conn, &REPLY_REJECT, 1);
+}
+
+void server_request::finish(int status) {
+    char reply[2] = {REPLY_DONE, char(std::min(status, 255))};
+    send_all(conn, reply, 2);
+}
+
+build_server::~build_server() {
+    close();
+}
+
+bool build_server::listen() {
+    sockaddr_un addr;
+    socket_addr(addr);
+    p_fd = socket_new();
+    if (p_fd < 0) {
+        return false;
+    }
+    auto *sa = reinterpret_cast<sockaddr *>(&addr);
+    if (bind(p_fd, sa, sizeof(addr))) {
+        bool stale = (errno == EADDRINUSE);
+        if (stale) {
+            /* left behind by a server that did not exit cleanly? */
+            int fd = socket_new();
+            stale = (fd >= 0) && connect(fd, sa, sizeof(addr));
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+        if (stale) {
+            unlink(SERVER_SOCKET_NAME);
+            stale = !bind(p_fd, sa, sizeof(addr));
+        }
+        if (!stale) {
+            ::close(p_fd);
+            p_fd = -1;
+            return false;
+        }
+    }
+    if (::listen(p_fd, 16)) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool build_server::accept(server_request &req) {
+#ifdef OSTD_PLATFORM_LINUX
+    req.conn = ::accept4(p_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    int rflags = MSG_CMSG_CLOEXEC;
+#else
+    req.conn = cloexec(::accept(p_fd, nullptr, nullptr));
+    int rflags = 0;
+#endif
+    if (req.conn < 0) {
+        return false;
+    }
+    std::uint32_t size;
+    int fds[2];
+    alignas(cmsghdr) char cbuf[CMSG_SPACE(sizeof(fds))];
+    iovec iov{&size, sizeof(size)};
+    msghdr mh{};
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf;
+    mh.msg_controllen = sizeof(cbuf);
+    if (recvmsg(req.conn, &mh, rflags) != ssize_t(sizeof(size))) {
+        return false;
+    }
+    auto *cm = CMSG_FIRSTHDR(&mh);
+    if (
+        !cm || (cm->cmsg_type != SCM_RIGHTS) ||
+        (cm->cmsg_len != CMSG_LEN(sizeof(fds)))
+    ) {
+        return false;
+    }
+    std::memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+#ifndef OSTD_PLATFORM_LINUX
+    cloexec(fds[0]);
+    cloexec(fds[1]);
+#endif
+    req.out = fds[0];
+    req.err = fds[1];
+    if (size > REQUEST_MAX) {
+        return false;
+    }
+    std::string msg(size, '\0');
+    if (!read_all(req.conn, msg.data(), size)) {
+        return false;
+    }
+    unsigned long long key, env;
+    std::size_t hlen = std::strlen(PROTOCOL);
+    if (
+        (msg.compare(0, hlen, PROTOCOL) != 0) || (msg.size() < (hlen + 35)) ||
+        (std::sscanf(msg.data() + hlen, "\n%16llx\n%16llx\n", &key, &env) != 2)
+    ) {
+        return false;
+    }
+    req.key = key;
+    req.env = env;
+    req.action = msg.substr(hlen + 35);
+    return true;
+}
+
+void build_server::close() {
+    if (p_fd < 0) {
+        return;
+    }
+    ::close(p_fd);
+    p_fd = -1;
+    unlink(SERVER_SOCKET_NAME);
+}
+
+} /* namespace obuild */
@@ -0,0 +1,74 @@
+#ifndef OBUILD_SERVER_HH
+#define OBUILD_SERVER_HH
+
+#include <cstdint>
+#include <string>
+
+namespace obuild {
+
+/* the socket of the build server, in the build directory */
+constexpr char const *SERVER_SOCKET_NAME = ".obuild_sock";
+
+/* the hash of the environment, which the server's has to match as the
+ * commands it runs get its environment and not the client's
+ */
+std::uint64_t env_hash();
+
+/* the thin client: hands the action to a server running in the current
+ * directory, with the standard output and error passed along so that
+ * the output is streamed straight to them; returns the exit status of
+ * the build, or -1 if there is no server able to take it
+ */
+int server_forward(
+    std::uint64_t key, std::uint64_t env, std::string const &action
+);
+
+/* one build requested by a client */
+struct server_request {
+    server_request() {}
+    server_request(server_request const &) = delete;
+    ~server_request();
+
+    server_request &operator=(server_request const &) = delete;
+
+    /* rejected requests get built by the client itself */
+    void reject();
+    void finish(int status);
+
+    std::uint64_t key = 0;
+    std::uint64_t env = 0;
+    std::string action;
+    /* the client's standard output and error */
+    int out = -1;
+    int err = -1;
+    int conn = -1;
+};
+
+struct build_server {
+    build_server() {}
+    build_server(build_server const &) = delete;
+    ~build_server();
+
+    build_server &operator=(build_server const &) = delete;
+
+    /* fails if another server is running in the directory */
+    bool listen();
+
+    /* readable when a client is waiting */
+    int fd() const {
+        return p_fd;
+    }
+
+    /* false for malformed requests, which are dropped */
+    bool accept(server_request &req);
+
+    /* stops listening, e.g. before the server replaces itself */
+    void close();
+
+private:
+    int p_fd = -1;
+};
+
+} /* namespace obuild */
+
+#endif
@@ -0,0 +1,101 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <algorithm>
+#include <string_view>
+
+#include <spawn.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "spawn.hh"
+
+extern char **environ;
+
+namespace obuild {
+
+/* anything the shell would interpret beyond splitting words */
+static constexpr char const *SHELL_CHARS = "|&;<>()$`\\\"'*?[]#~{}\n";
+
+/* words that only mean something to the shell as the first one: its
+ * keywords and the builtins that have no executable or act on the shell
+ * itself; sorted for the binary search
+ */
+static constexpr std::string_view SHELL_WORDS[] = {
+    "!", ".", ":", "[[", "alias", "bg", "break", "case", "cd", "command",
+    "continue", "do", "done", "elif", "else", "esac", "eval", "exec", "exit",
+    "export", "fc", "fg", "fi", "for", "function", "getopts", "hash", "if",
+    "jobs", "local", "read", "readonly", "return", "select", "set", "shift",
+    "source", "then", "time", "times", "trap", "type", "ulimit", "umask",
+    "unalias", "unset", "until", "wait", "while"
+};
+
+bool split_command(std::string const &cmd, std::vector<std::string> &args) {
+    args.clear();
+    if (cmd.find_first_of(SHELL_CHARS) != cmd.npos) {
+        return false;
+    }
+    std::size_t i = 0;
+    for (;;) {
+        i = cmd.find_first_not_of(" \t", i);
+        if (i == cmd.npos) {
+            break;
+        }
+        auto e = cmd.find_first_of(" \t", i);
+        args.emplace_back(cmd, i, e - i);
+        i = e;
+    }
+    if (args.empty() || std::binary_search(
+        std::begin(SHELL_WORDS), std::end(SHELL_WORDS), args[0]
+    )) {
+        return false;
+    }
+    /* leading variable assignments */
+    return (args[0].find('=') == args[0].npos);
+}
+
+static int spawn_wait(char const *path, char * const *argv) {
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+#ifdef POSIX_SPAWN_USEVFORK
+    /* never copy the page tables of our (possibly large) process */
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_USEVFORK);
+#endif
+    pid_t pid;
+    int err = posix_spawnp(&pid, path, nullptr, &attr, argv, environ);
+    posix_spawnattr_destroy(&attr);
+    if (err) {
+        std::fprintf(stderr, "%s: %s\n", path, std::strerror(err));
+        /* what a shell would return for a command it cannot find */
+        return 127;
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+    return 128 + WTERMSIG(status);
+}
+
+int run_command(std::string const &cmd) {
+    std::vector<std::string> args;
+    std::vector<char *> argv;
+    if (split_command(cmd, args)) {
+        for (auto &arg: args) {
+            argv.push_back(arg.data());
+        }
+        argv.push_back(nullptr);
+        return spawn_wait(argv[0], argv.data());
+    }
+    char sh[] = "/bin/sh", c[] = "-c";
+    std::string cmdbuf{cmd};
+    char *shargv[] = {sh, c, cmdbuf.data(), nullptr};
+    return spawn_wait(sh, shargv);
+}
+
+} /* namespace obuild */
@@ -0,0 +1,23 @@
+#ifndef OBUILD_SPAWN_HH
+#define OBUILD_SPAWN_HH
+
+#include <string>
+#include <vector>
+
+namespace obuild {
+
+/* splits a command line into arguments if it can be run without a shell,
+ * i.e. when it contains no quoting, expansions, redirections and so on and
+ * does not start with a shell keyword, builtin or variable assignment
+ */
+bool split_command(std::string const &cmd, std::vector<std::string> &args);
+
+/* runs the command and returns its exit status (like system, 0 is success);
+ * the tool is spawned directly whenever possible, /bin/sh is only used for
+ * commands that need it
+ */
+int run_command(std::string const &cmd);
+
+} /* namespace obuild */
+
+#endif
@@ -0,0 +1,748 @@
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <algorithm>
+
+#include <ostd/platform.hh>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "state.hh"
+#include "depfile.hh"
+#include "cache.hh"
+#include "trace.hh"
+#include "jobserver.hh"
+#include "throttle.hh"
+#include "pool.hh"
+#include "hashes.hh"
+
+namespace obuild {
+
+static constexpr char const *LOG_HEADER = "# obuild log 4\n";
+
+/* rewrite the log once it is mostly made of stale records */
+static constexpr std::size_t LOG_COMPACT_MIN = 1000;
+static constexpr std::size_t LOG_COMPACT_RATIO = 3;
+
+std::uint64_t hash_string(std::string_view str, std::uint64_t h) {
+    /* 64-bit FNV-1a, stable across runs and platforms */
+    if (!h) {
+        h = 14695981039346656037ULL;
+    }
+    for (unsigned char c: str) {
+        h ^= c;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+std::int64_t time_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()
+    ).count();
+}
+
+file_info stat_info(struct stat const &st) {
+    file_info ret;
+#ifdef OSTD_PLATFORM_OSX
+    auto &mt = st.st_mtimespec;
+#else
+    auto &mt = st.st_mtim;
+#endif
+    ret.mtime = std::int64_t(mt.tv_sec) * 1000000000;
+    ret.mtime += mt.tv_nsec;
+    ret.size = std::int64_t(st.st_size);
+    return ret;
+}
+
+file_info stat_file(std::string const &path) {
+    struct stat st;
+    if (stat(path.data(), &st)) {
+        return file_info{};
+    }
+    return stat_info(st);
+}
+
+file_info stat_file(int fd) {
+    struct stat st;
+    if (fstat(fd, &st)) {
+        return file_info{};
+    }
+    return stat_info(st);
+}
+
+file_info stat_cache::get(std::string const &path) {
+    {
+        std::lock_guard<std::mutex> l{p_lock};
+        auto it = p_files.find(path);
+        if (it != p_files.end()) {
+            return it->second;
+        }
+    }
+    auto ret = stat_file(path);
+    std::lock_guard<std::mutex> l{p_lock};
+    p_files.emplace(path, ret);
+    return ret;
+}
+
+void stat_cache::invalidate(std::string const &path) {
+    std::lock_guard<std::mutex> l{p_lock};
+    p_files.erase(path);
+}
+
+void sort_unique(std::vector<std::string> &names) {
+    std::sort(names.begin(), names.end());
+    names.erase(std::unique(names.begin(), names.end()), names.end());
+}
+
+bool read_file(std::string const &path, std::string &data) {
+    int fd = open(path.data(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st)) {
+        close(fd);
+        return false;
+    }
+    data.resize(std::size_t(st.st_size));
+    std::size_t rd = 0;
+    while (rd < data.size()) {
+        auto r = read(fd, &data[rd], data.size() - rd);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            return false;
+        }
+        if (!r) {
+            break;
+        }
+        rd += std::size_t(r);
+    }
+    close(fd);
+    data.resize(rd);
+    return true;
+}
+
+file_map::~file_map() {
+    if (p_map) {
+        munmap(p_map, p_size);
+    }
+}
+
+bool file_map::open(std::string const &path) {
+    bool in = (path == "-");
+    int fd = in ? 0 : ::open(path.data(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st)) {
+        if (!in) {
+            close(fd);
+        }
+        return false;
+    }
+    if (S_ISREG(st.st_mode) && (st.st_size > 0)) {
+        void *p = mmap(
+            nullptr, std::size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0
+        );
+        if (p != MAP_FAILED) {
+            if (!in) {
+                close(fd);
+            }
+            p_map = static_cast<char *>(p);
+            p_size = std::size_t(st.st_size);
+            return true;
+        }
+    }
+    /* not mappable, read it in chunks until the end */
+    char buf[65536];
+    for (;;) {
+        auto r = read(fd, buf, sizeof(buf));
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (!in) {
+                close(fd);
+            }
+            return false;
+        }
+        if (!r) {
+            break;
+        }
+        p_buf.append(buf, std::size_t(r));
+    }
+    if (!in) {
+        close(fd);
+    }
+    return true;
+}
+
+/* build log */
+
+build_log::~build_log() {
+    if (p_file) {
+        std::fclose(p_file);
+    }
+}
+
+static bool valid_name(std::string_view s) {
+    return !s.empty() && (s.find_first_of("\t\n") == s.npos);
+}
+
+static bool read_line(std::FILE *f, std::string &line) {
+    line.clear();
+    for (int c; (c = std::fgetc(f)) != EOF;) {
+        if (c == '\n') {
+            return true;
+        }
+        line += char(c);
+    }
+    return !line.empty();
+}
+
+/* splits off the next tab-delimited field */
+static bool next_field(std::string_view &s, std::string_view &field) {
+    if (s.empty()) {
+        return false;
+    }
+    auto tab = s.find('\t');
+    field = s.substr(0, tab);
+    s = (tab == s.npos) ? std::string_view{} : s.substr(tab + 1);
+    return true;
+}
+
+static bool next_int(std::string_view &s, std::int64_t &v, int base = 10) {
+    std::string_view f;
+    if (!next_field(s, f) || f.empty()) {
+        return false;
+    }
+    std::string buf{f};
+    char *end = nullptr;
+    v = std::int64_t(std::strtoull(buf.data(), &end, base));
+    return !*end;
+}
+
+static bool parse_files(
+    std::string_view &line, std::vector<std::pair<std::string, file_info>> &fs
+) {
+    std::int64_t nfiles, hash;
+    if (!next_int(line, nfiles) || (nfiles < 0)) {
+        return false;
+    }
+    fs.reserve(std::size_t(nfiles));
+    for (std::int64_t i = 0; i < nfiles; ++i) {
+        std::string_view path;
+        file_info fi;
+        if (
+            !next_field(line, path) ||
+            !next_int(line, fi.mtime) || !next_int(line, fi.size) ||
+            !next_int(line, hash, 16)
+        ) {
+            return false;
+        }
+        fi.hash = std::uint64_t(hash);
+        fs.emplace_back(std::string{path}, fi);
+    }
+    return true;
+}
+
+static bool parse_entry(
+    std::string_view line, std::string &target, log_entry &ent
+) {
+    std::int64_t hash;
+    std::string_view tgt;
+    if (
+        !next_int(line, ent.start) || !next_int(line, ent.end) ||
+        !next_int(line, ent.output.mtime) || !next_int(line, ent.output.size) ||
+        !next_int(line, hash, 16) || !next_field(line, tgt) ||
+        !parse_files(line, ent.inputs) || !next_int(line, ent.ndeps)
+    ) {
+        return false;
+    }
+    ent.cmd_hash = std::uint64_t(hash);
+    target = tgt;
+    return line.empty();
+}
+
+bool build_log::load() {
+    std::FILE *f = std::fopen(p_path.data(), "rb");
+    if (!f) {
+        return false;
+    }
+    std::string line;
+    if (!read_line(f, line) || ((line + '\n') != LOG_HEADER)) {
+        /* unknown version, start over */
+        std::fclose(f);
+        return false;
+    }
+    std::string target;
+    while (read_line(f, line)) {
+        log_entry ent;
+        if (!parse_entry(line, target, ent)) {
+            /* most likely a partial write from an interrupted build */
+            continue;
+        }
+        p_entries[target] = std::make_shared<log_entry const>(std::move(ent));
+        ++p_records;
+    }
+    std::fclose(f);
+    return true;
+}
+
+static void write_files(
+    std::FILE *f, std::vector<std::pair<std::string, file_info>> const &fs
+) {
+    std::fprintf(f, "\t%zu", fs.size());
+    for (auto &in: fs) {
+        std::fprintf(
+            f, "\t%s\t%lld\t%lld\t%llx", in.first.data(),
+            static_cast<long long>(in.second.mtime),
+            static_cast<long long>(in.second.size),
+            static_cast<unsigned long long>(in.second.hash)
+        );
+    }
+}
+
+void build_log::write_entry(std::string const &target, log_entry const &ent) {
+    std::fprintf(
+        p_file, "%lld\t%lld\t%lld\t%lld\t%llx\t%s",
+        static_cast<long long>(ent.start), static_cast<long long>(ent.end),
+        static_cast<long long>(ent.output.mtime),
+        static_cast<long long>(ent.output.size),
+        static_cast<unsigned long long>(ent.cmd_hash), target.data()
+    );
+    write_files(p_file, ent.inputs);
+    std::fprintf(p_file, "\t%lld\n", static_cast<long long>(ent.ndeps));
+}
+
+bool build_log::write_all() {
+    auto tmp = p_path + ".tmp";
+    p_file = std::fopen(tmp.data(), "wb");
+    if (!p_file) {
+        return false;
+    }
+    std::fputs(LOG_HEADER, p_file);
+    for (auto &p: p_entries) {
+        write_entry(p.first, *p.second);
+    }
+    p_records = p_entries.size();
+    if (std::fclose(p_file) || std::rename(tmp.data(), p_path.data())) {
+        p_file = nullptr;
+        return false;
+    }
+    p_file = nullptr;
+    return true;
+}
+
+bool build_log::open(std::string path) {
+    p_path = std::move(path);
+    if (!load() || (
+        (p_records > LOG_COMPACT_MIN) &&
+        (p_records > (p_entries.size() * LOG_COMPACT_RATIO))
+    )) {
+        if (!write_all()) {
+            return false;
+        }
+    }
+    p_file = std::fopen(p_path.data(), "ab");
+    return !!p_file;
+}
+
+std::shared_ptr<log_entry const> build_log::find(
+    std::string const &target
+) const {
+    std::lock_guard<std::mutex> l{p_lock};
+    auto it = p_entries.find(target);
+    if (it == p_entries.end()) {
+        return nullptr;
+    }
+    return it->second;
+}
+
+std::int64_t build_log::mean_duration() const {
+    std::lock_guard<std::mutex> l{p_lock};
+    std::int64_t sum = 0;
+    for (auto &p: p_entries) {
+        sum += p.second->end - p.second->start;
+    }
+    return p_entries.empty() ? 0 : (sum / std::int64_t(p_entries.size()));
+}
+
+void build_log::record(std::string const &target, log_entry ent) {
+    if (!valid_name(target)) {
+        return;
+    }
+    for (auto &in: ent.inputs) {
+        if (!valid_name(in.first)) {
+            return;
+        }
+    }
+    std::lock_guard<std::mutex> l{p_lock};
+    if (p_file) {
+        write_entry(target, ent);
+        /* keep the log consistent even if we get killed */
+        std::fflush(p_file);
+        ++p_records;
+    }
+    p_entries[target] = std::make_shared<log_entry const>(std::move(ent));
+}
+
+/* jobs */
+
+build_job::build_job(build_state &st, std::string target):
+    p_state{st}, p_target{std::move(target)}
+{}
+
+void build_job::release() {
+    if ((--p_refs > 0) || p_discard) {
+        return;
+    }
+    entry.end = time_ms();
+    auto start = p_start.load();
+    entry.start = start ? start : entry.end;
+    p_state.finish(*this);
+}
+
+void build_job::add_command(std::string_view cmd) {
+    auto b = cmd.find_first_not_of(" \t");
+    if (b != cmd.npos) {
+        auto e = cmd.find_first_of(" \t", b);
+        tools.emplace_back(cmd.substr(b, e - b));
+    }
+    entry.cmd_hash = hash_string(cmd, entry.cmd_hash);
+    /* separate the commands so that splitting one up changes the hash */
+    entry.cmd_hash = hash_string("\n", entry.cmd_hash);
+}
+
+void build_job::defer(std::function<void()> step, bool command) {
+    p_steps.emplace_back(command, std::move(step));
+}
+
+void build_job::run_steps(bool commands) {
+    auto steps = std::move(p_steps);
+    for (auto &step: steps) {
+        if (commands || !step.first) {
+            step.second();
+        }
+    }
+}
+
+void build_job::task_started() {
+    std::int64_t none = 0;
+    p_start.compare_exchange_strong(none, time_ms());
+}
+
+/* build state */
+
+build_state::build_state() {}
+
+build_state::~build_state() {}
+
+void build_state::attach(void const *key, std::shared_ptr<build_job> job) {
+    p_jobs[key] = std::move(job);
+}
+
+void build_state::detach(void const *key) {
+    p_jobs.erase(key);
+}
+
+std::shared_ptr<build_job> build_state::current(void const *key) const {
+    auto it = p_jobs.find(key);
+    if (it == p_jobs.end()) {
+        return nullptr;
+    }
+    return it->second;
+}
+
+void build_state::finish(build_job &job) {
+    if (!job.depfile.empty()) {
+        std::vector<std::string> found;
+        if (!read_depfile(job.depfile, found)) {
+            /* leave it out of the log so that it gets rebuilt */
+            return;
+        }
+        sort_unique(found);
+        deps_log::dep_list dl;
+        for (auto &dep: found) {
+            if (!valid_name(dep)) {
+                return;
+            }
+            auto fi = input_info(dep);
+            dl.emplace_back(std::move(dep), fi);
+        }
+        job.entry.ndeps = std::int64_t(dl.size());
+        deps.record(job.target(), dl);
+        if (job.cache_key) {
+            cache->store(job.cache_key, job.target(), dl);
+        }
+    } else if (job.cache_key) {
+        cache->store(job.cache_key, job.target(), deps_log::dep_list{});
+    }
+    for (auto &out: job.outputs) {
+        log_entry ent;
+        ent.start = job.entry.start;
+        ent.end = job.entry.end;
+        ent.cmd_hash = job.entry.cmd_hash;
+        ent.inputs = job.entry.inputs;
+        stats.invalidate(out);
+        ent.output = stats.get(out);
+        log.record(out, std::move(ent));
+    }
+    stats.invalidate(job.target());
+    job.entry.output = stats.get(job.target());
+    log.record(job.target(), std::move(job.entry));
+}
+
+bool build_state::up_to_date(std::string const &target) {
+    auto it = p_checked.find(target);
+    if (it != p_checked.end()) {
+        /* a dependency cycle is left for build::make to diagnose */
+        return it->second == check_state::DONE;
+    }
+    p_checked.emplace(target, check_state::ACTIVE);
+    bool ret = check_target(target);
+    p_checked[target] = ret ? check_state::DONE : check_state::STALE;
+    return ret;
+}
+
+void build_state::reset_graph() {
+    graph = rule_graph{};
+    p_checked.clear();
+    p_paths.clear();
+}
+
+void build_state::files_changed(std::vector<std::string> const &paths) {
+    for (auto &path: paths) {
+        stats.invalidate(path);
+    }
+    p_checked.clear();
+    p_paths.clear();
+}
+
+std::int64_t build_state::critical_path(std::string const &target) {
+    auto it = p_paths.find(target);
+    if (it != p_paths.end()) {
+        return it->second;
+    }
+    /* also guards against cycles */
+    p_paths.emplace(target, 0);
+    auto nd = graph.resolve(target);
+    std::int64_t ret = 0;
+    for (auto &dep: nd.deps) {
+        ret = std::max(ret, critical_path(dep));
+    }
+    for (auto &dep: nd.implicit) {
+        ret = std::max(ret, critical_path(dep));
+    }
+    for (auto &dep: nd.order) {
+        ret = std::max(ret, critical_path(dep));
+    }
+    if (nd.body && !nd.action) {
+        if (auto ent = log.find(target); ent) {
+            ret += ent->end - ent->start;
+        } else {
+            if (p_mean < 0) {
+                p_mean = log.mean_duration();
+            }
+            ret += p_mean;
+        }
+    }
+    p_paths[target] = ret;
+    return ret;
+}
+
+bool build_state::check_target(std::string const &target) {
+    auto nd = graph.resolve(target);
+    if (!nd.found) {
+        /* a plain source file */
+        return stats.get(target).exists();
+    }
+    for (auto &dep: nd.deps) {
+        if (!up_to_date(dep)) {
+            return false;
+        }
+    }
+    for (auto &dep: nd.implicit) {
+        if (!up_to_date(dep)) {
+            return false;
+        }
+    }
+    for (auto &dep: nd.order) {
+        if (!up_to_date(dep)) {
+            return false;
+        }
+    }
+    if (!nd.body) {
+        return true;
+    }
+    if (nd.action) {
+        return false;
+    }
+    auto ent = log.find(target);
+    if (!ent) {
+        return false;
+    }
+    /* the set of inputs may have changed through the config; if not,
+     * evaluate the body with the sources in their current order like the
+     * build would, a reordering (e.g. of linked objects) changes the hash
+     */
+    std::vector<std::string> recorded, current = nd.deps;
+    for (auto &in: ent->inputs) {
+        recorded.push_back(in.first);
+    }
+    sort_unique(recorded);
+    sort_unique(current);
+    if (recorded != current) {
+        return false;
+    }
+    log_entry now;
+    for (auto &name: nd.deps) {
+        auto fi = stats.get(name);
+        now.inputs.emplace_back(name, fi);
+    }
+    now.cmd_hash = nd.body(target, nd.deps);
+    return check_entry(target, *ent, now) && check_outputs(
+        nd.group, now.cmd_hash
+    );
+}
+
+std::vector<
+    std::pair<std::string, std::vector<std::string>>
+> build_state::implicit_deps() {
+    std::vector<std::pair<std::string, std::vector<std::string>>> ret;
+    std::unordered_map<std::string const *, bool> built;
+    deps.each([this, &ret, &built](
+        std::string const &target, std::vector<std::string const *> const &ds
+    ) {
+        std::vector<std::string> gen;
+        for (auto *dep: ds) {
+            auto it = built.find(dep);
+            if (it == built.end()) {
+                it = built.emplace(dep, graph.resolve(*dep).found).first;
+            }
+            if (it->second) {
+                gen.push_back(*dep);
+            }
+        }
+        if (gen.empty() || !graph.resolve(target).found) {
+            return;
+        }
+        graph.add_implicit(target, gen);
+        ret.emplace_back(target, std::move(gen));
+    });
+    return ret;
+}
+
+bool build_state::outdated(build_job &job) {
+    auto &now = job.entry;
+    if (!check_outputs(job.outputs, now.cmd_hash)) {
+        return true;
+    }
+    auto ent = log.find(job.target());
+    if (ent) {
+        return !check_entry(job.target(), *ent, now);
+    }
+    /* not built by obuild before, trust the timestamps */
+    auto out = stats.get(job.target());
+    if (!out.exists()) {
+        return true;
+    }
+    for (auto &in: now.inputs) {
+        if (!in.second.exists() || (in.second.mtime > out.mtime)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+file_info build_state::input_info(std::string const &path) {
+    auto fi = stats.get(path);
+    if (
+        hashes && fi.exists() && (hash_inputs || graph.resolve(path).restat)
+    ) {
+        fi.hash = hashes->get(path);
+    }
+    return fi;
+}
+
+bool build_state::unchanged(std::string const &path, file_info const &logged) {
+    auto fi = stats.get(path);
+    if (fi == logged) {
+        return true;
+    }
+    /* touched, e.g. by a checkout or by rebuilding a restat rule, but
+     * possibly with the same contents
+     */
+    return hashes && logged.hash && fi.exists() && (
+        hashes->get(path) == logged.hash
+    );
+}
+
+/* the other outputs of a group, logged by the job of the primary one */
+bool build_state::check_outputs(
+    std::vector<std::string> const &outputs, std::uint64_t cmd_hash
+) {
+    for (auto &out: outputs) {
+        auto ent = log.find(out);
+        if (!ent || (ent->cmd_hash != cmd_hash)) {
+            return false;
+        }
+        auto fi = stats.get(out);
+        if (!fi.exists() || (fi != ent->output)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool build_state::check_entry(
+    std::string const &target, log_entry const &ent, log_entry const &now
+) {
+    if (ent.cmd_hash != now.cmd_hash) {
+        return false;
+    }
+    auto out = stats.get(target);
+    if (!out.exists() || (out != ent.output)) {
+        return false;
+    }
+    if (ent.inputs.size() != now.inputs.size()) {
+        return false;
+    }
+    std::unordered_map<std::string_view, file_info> ins;
+    for (auto &in: ent.inputs) {
+        ins.emplace(in.first, in.second);
+    }
+    for (auto &in: now.inputs) {
+        auto it = ins.find(in.first);
+        if ((it == ins.end()) || !unchanged(in.first, it->second)) {
+            return false;
+        }
+    }
+    if (ent.ndeps < 0) {
+        return true;
+    }
+    deps_log::dep_list dl;
+    deps.find(target, dl);
+    if (std::int64_t(dl.size()) != ent.ndeps) {
+        /* the deps log got lost or is from a different build */
+        return false;
+    }
+    for (auto &dep: dl) {
+        if (!unchanged(dep.first, dep.second)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+} /* namespace obuild */
@@ -0,0 +1,490 @@
+#ifndef OBUILD_STATE_HH
+#define OBUILD_STATE_HH
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <utility>
+#include <optional>
+#include <functional>
+
+#include "graph.hh"
+
+struct stat;
+
+namespace obuild {
+
+/* the default name of the per build directory log */
+constexpr char const *BUILD_LOG_NAME = ".obuild_log";
+constexpr char const *DEPS_LOG_NAME = ".obuild_deps";
+constexpr char const *GRAPH_CACHE_NAME = ".obuild_graph";
+constexpr char const *GLOB_CACHE_NAME = ".obuild_glob";
+constexpr char const *HASH_CACHE_NAME = ".obuild_hashes";
+/* shared by all of the above and their temporary files */
+constexpr char const *STATE_PREFIX = ".obuild_";
+
+std::uint64_t hash_string(std::string_view str, std::uint64_t h = 0);
+
+/* milliseconds since the epoch */
+std::int64_t time_ms();
+
+/* the bits of stat(2) used for staleness decisions */
+struct file_info {
+    std::int64_t mtime = -1; /* nanoseconds, -1 if the file is missing */
+    std::int64_t size = 0;
+    /* of the contents when hashing inputs or of the listing of
+     * a directory, 0 if not known; not compared
+     */
+    std::uint64_t hash = 0;
+
+    bool exists() const {
+        return mtime >= 0;
+    }
+
+    bool operator==(file_info const &o) const {
+        return (mtime == o.mtime) && (size == o.size);
+    }
+
+    bool operator!=(file_info const &o) const {
+        return !(*this == o);
+    }
+};
+
+file_info stat_file(std::string const &path);
+/* of an open file */
+file_info stat_file(int fd);
+/* of what stat(2) returned, whatever the platform calls the fields */
+file_info stat_info(struct stat const &st);
+
+void sort_unique(std::vector<std::string> &names);
+
+/* reads the whole file with as few syscalls as possible */
+bool read_file(std::string const &path, std::string &data);
+
+/* the contents of a file, mapped read-only when it is a regular file and
+ * read into memory otherwise (pipes, terminals); "-" is standard input
+ */
+struct file_map {
+    file_map() {}
+    file_map(file_map const &) = delete;
+    ~file_map();
+
+    file_map &operator=(file_map const &) = delete;
+
+    bool open(std::string const &path);
+
+    std::string_view data() const {
+        return p_map ? std::string_view{p_map, p_size} : p_buf;
+    }
+
+private:
+    char *p_map = nullptr;
+    std::size_t p_size = 0;
+    std::string p_buf;
+};
+
+/* the phony target through which discovered dependencies of a target
+ * that are built by other rules get ordered before it
+ */
+constexpr std::string_view IMPLICIT_PREFIX = "obuild:deps:";
+/* likewise for order-only dependencies */
+constexpr std::string_view ORDER_PREFIX = "obuild:order:";
+
+/* each file is stat'd at most once per build unless invalidated */
+struct stat_cache {
+    file_info get(std::string const &path);
+    void invalidate(std::string const &path);
+
+private:
+    std::mutex p_lock;
+    std::unordered_map<std::string, file_info> p_files;
+};
+
+struct log_entry {
+    std::int64_t start = 0;
+    std::int64_t end = 0;
+    file_info output;
+    std::uint64_t cmd_hash = 0;
+    /* in the order the rule body got them */
+    std::vector<std::pair<std::string, file_info>> inputs;
+    /* the number of dependencies discovered through a depfile, which
+     * live in the deps log; -1 if the rule did not use a depfile
+     */
+    std::int64_t ndeps = -1;
+};
+
+/* append-only log of finished targets; later records win on load */
+struct build_log {
+    build_log() {}
+    build_log(build_log const &) = delete;
+    ~build_log();
+
+    build_log &operator=(build_log const &) = delete;
+
+    /* loads the log and opens it for appending, compacting if needed */
+    bool open(std::string path);
+
+    std::shared_ptr<log_entry const> find(std::string const &target) const;
+
+    /* of all logged jobs, in milliseconds */
+    std::int64_t mean_duration() const;
+
+    /* thread safe, may be called from task threads */
+    void record(std::string const &target, log_entry ent);
+
+private:
+    bool load();
+    bool write_all();
+    void write_entry(std::string const &target, log_entry const &ent);
+
+    std::string p_path;
+    std::FILE *p_file = nullptr;
+    std::size_t p_records = 0;
+    mutable std::mutex p_lock;
+    std::unordered_map<
+        std::string, std::shared_ptr<log_entry const>
+    > p_entries;
+};
+
+/* binary append-only log of discovered dependencies; every path is
+ * written once and referred to by its index afterwards, the whole log
+ * is read in one go on startup
+ */
+struct deps_log {
+    using dep_list = std::vector<std::pair<std::string, file_info>>;
+
+    deps_log() {}
+    deps_log(deps_log const &) = delete;
+    ~deps_log();
+
+    deps_log &operator=(deps_log const &) = delete;
+
+    bool open(std::string path);
+
+    /* false if nothing was recorded for the target */
+    bool find(std::string const &target, dep_list &deps) const;
+
+    /* thread safe, may be called from task threads */
+    void record(std::string const &target, dep_list const &deps);
+
+    /* calls the function for every target with recorded dependencies */
+    template<typename F>
+    void each(F &&func) const {
+        std::lock_guard<std::mutex> l{p_lock};
+        std::vector<std::string const *> deps;
+        for (std::size_t i = 0; i < p_deps.size(); ++i) {
+            if (p_deps[i].empty()) {
+                continue;
+            }
+            deps.clear();
+            for (auto &d: p_deps[i]) {
+                deps.push_back(&p_paths[d.id]);
+            }
+            func(p_paths[i], deps);
+        }
+    }
+
+private:
+    struct dep {
+        std::uint32_t id;
+        file_info info;
+    };
+
+    bool load();
+    bool write_all();
+    std::uint32_t intern(std::string const &path);
+    void write_path(std::string const &path);
+    void write_deps(std::uint32_t id, std::vector<dep> const &deps);
+
+    std::string p_path;
+    std::FILE *p_file = nullptr;
+    std::size_t p_records = 0;
+    std::size_t p_live = 0;
+    mutable std::mutex p_lock;
+    /* a deque so that the views in the id map stay valid */
+    std::deque<std::string> p_paths;
+    std::unordered_map<std::string_view, std::uint32_t> p_ids;
+    /* indexed by the id of the target */
+    std::vector<std::vector<dep>> p_deps;
+};
+
+/* records everything the evaluation of the build scripts depended on,
+ * so that the resulting rule graph can be reused while none of it changes
+ */
+struct config_cache {
+    /* the graph can only be reused if it was the only outcome */
+    void begin() {
+        p_evaluating = true;
+    }
+
+    void end() {
+        p_evaluating = false;
+    }
+
+    bool evaluating() const {
+        return p_evaluating;
+    }
+
+    void uncacheable() {
+        p_cacheable = false;
+    }
+
+    void add_file(std::string const &path, std::string_view data);
+    /* with the hash_file of the contents, 0 if it cannot be read */
+    void add_file(
+        std::string const &path, file_info const &info, std::uint64_t hash
+    );
+    void add_env(
+        std::string const &name, std::optional<std::string> const &val
+    );
+    void add_dir(std::string const &path, file_info const &info);
+    /* printed during evaluation, printed again when reusing the graph */
+    void add_output(std::string_view line);
+
+    /* fills the graph if nothing changed since the cache was saved;
+     * cached rules get the given body, as their commands cannot change
+     */
+    bool load(
+        std::string const &path, std::uint64_t options, rule_graph &graph,
+        body_hash const &body, std::vector<std::string> &output
+    );
+
+    bool save(
+        std::string const &path, std::uint64_t options,
+        rule_graph const &graph
+    );
+
+    std::vector<std::string> const &output() const {
+        return p_output;
+    }
+
+    /* calls the function for every file and directory the evaluation
+     * depended on, with true for directories
+     */
+    template<typename F>
+    void each_input(F &&func) const {
+        for (auto &p: p_files) {
+            func(p.first, false);
+        }
+        for (auto &p: p_dirs) {
+            func(p.first, true);
+        }
+    }
+
+private:
+    struct file {
+        file_info info;
+        std::uint64_t hash;
+    };
+
+    std::unordered_map<std::string, file> p_files;
+    std::unordered_map<std::string, std::optional<std::string>> p_env;
+    std::unordered_map<std::string, file_info> p_dirs;
+    std::vector<std::string> p_output;
+    bool p_evaluating = false;
+    bool p_cacheable = true;
+};
+
+/* the results of glob patterns along with the stat info of directories
+ * they were read from, so that unchanged directories are not read again
+ */
+struct glob_cache {
+    struct result {
+        std::vector<std::pair<std::string, file_info>> dirs;
+        std::vector<std::string> matches;
+        /* whether the directories were looked at in this run */
+        bool checked = false;
+    };
+
+    bool open(std::string path);
+    bool save();
+
+    result const &match(
+        std::string const &pattern, std::vector<std::string> const &excludes
+    );
+
+    /* after an entry of a directory appeared or went away: whether some
+     * pattern matched in this run that read it now matches differently;
+     * directories read for the first time are added to dirs, true if no
+     * pattern read it
+     */
+    bool changed(std::string const &dir, std::vector<std::string> &dirs);
+
+    /* for reading directories of recursive patterns */
+    int threads = 1;
+
+private:
+    std::string p_path;
+    std::unordered_map<std::string, result> p_entries;
+    bool p_dirty = false;
+};
+
+struct build_state;
+struct job_pool;
+
+/* one invocation of a rule body; the body and each of its tasks hold
+ * a reference and the job is logged once the last one is released
+ *
+ * the body is evaluated first, with everything it would do deferred
+ * into the job, so that obuild can decide whether it needs to run
+ */
+struct build_job: std::enable_shared_from_this<build_job> {
+    build_job(build_state &st, std::string target);
+    build_job(build_job const &) = delete;
+
+    build_job &operator=(build_job const &) = delete;
+
+    /* commands make up the hash compared against the log */
+    void add_command(std::string_view cmd);
+    /* command steps are skipped when the output comes from the cache */
+    void defer(std::function<void()> step, bool command = false);
+    void run_steps(bool commands = true);
+
+    void task_started();
+
+    void hold() {
+        ++p_refs;
+    }
+
+    void release();
+
+    /* the job will not be logged, because it failed or did not run */
+    void discard() {
+        p_discard = true;
+    }
+
+    std::string const &target() const {
+        return p_target;
+    }
+
+    log_entry entry;
+    /* read once the job is done */
+    std::string depfile;
+    /* the programs run by the commands, part of the artifact cache key */
+    std::vector<std::string> tools;
+    /* produced along with the target, logged with the same commands */
+    std::vector<std::string> outputs;
+    /* the output is stored in the artifact cache under this key */
+    std::uint64_t cache_key = 0;
+    bool cacheable = true;
+    /* limits the concurrency of the commands if set */
+    job_pool *pool = nullptr;
+
+private:
+    build_state &p_state;
+    std::string p_target;
+    std::atomic<std::int64_t> p_start{0};
+    std::atomic<int> p_refs{1};
+    std::atomic<bool> p_discard{false};
+    std::vector<std::pair<bool, std::function<void()>>> p_steps;
+};
+
+struct artifact_cache;
+struct build_trace;
+struct jobserver;
+struct load_throttle;
+struct hash_cache;
+
+struct build_state {
+    build_state();
+    ~build_state();
+
+    stat_cache stats;
+    build_log log;
+    deps_log deps;
+    config_cache config;
+    glob_cache globs;
+    rule_graph graph;
+    /* opt-in, null if disabled */
+    std::unique_ptr<artifact_cache> cache;
+    /* null unless tracing */
+    std::unique_ptr<build_trace> trace;
+    /* null if there is no jobserver to take tokens from */
+    std::unique_ptr<jobserver> tokens;
+    /* null unless a load or pressure limit was given */
+    std::unique_ptr<load_throttle> throttle;
+    std::unique_ptr<hash_cache> hashes;
+    /* staleness is decided by the contents of all inputs, rather than
+     * just those of the outputs of restat rules
+     */
+    bool hash_inputs = false;
+    /* defined by the build script, never removed while building */
+    std::unordered_map<std::string, std::unique_ptr<job_pool>> pools;
+
+    /* true if everything needed for the target is known to be up to date,
+     * i.e. nothing changed since the log was written; may be conservative
+     */
+    bool up_to_date(std::string const &target);
+
+    /* forgets the graph, e.g. when a cached one turned out to be stale */
+    void reset_graph();
+
+    /* forgets everything known about the files, for another build by
+     * the same process
+     */
+    void files_changed(std::vector<std::string> const &paths);
+
+    /* the logged duration of the longest chain of jobs the target needs,
+     * including its own, in milliseconds; jobs without history count as
+     * the mean duration
+     */
+    std::int64_t critical_path(std::string const &target);
+
+    /* the stat info of an input, with its content hash if hashing all
+     * inputs or if it is the output of a restat rule
+     */
+    file_info input_info(std::string const &path);
+
+    /* whether the input is the same as when it was logged: with the same
+     * stat info or, when hashing, with the same contents
+     */
+    bool unchanged(std::string const &path, file_info const &logged);
+
+    /* whether the job's body has to run, based on the log if possible
+     * and on timestamps otherwise
+     */
+    bool outdated(build_job &job);
+
+    /* for every target, the discovered dependencies which are built by
+     * a rule of their own; they are also added to the graph
+     */
+    std::vector<
+        std::pair<std::string, std::vector<std::string>>
+    > implicit_deps();
+
+    /* jobs are bound to the identity of the evaluating cubescript thread */
+    void attach(void const *key, std::shared_ptr<build_job> job);
+    void detach(void const *key);
+    std::shared_ptr<build_job> current(void const *key) const;
+
+    void finish(build_job &job);
+
+private:
+    enum class check_state {
+        ACTIVE, DONE, STALE
+    };
+
+    bool check_target(std::string const &target);
+    bool check_entry(
+        std::string const &target, log_entry const &ent, log_entry const &now
+    );
+    bool check_outputs(
+        std::vector<std::string> const &outputs, std::uint64_t cmd_hash
+    );
+
+    std::unordered_map<void const *, std::shared_ptr<build_job>> p_jobs;
+    std::unordered_map<std::string, check_state> p_checked;
+    std::unordered_map<std::string, std::int64_t> p_paths;
+    std::int64_t p_mean = -1;
+};
+
+} /* namespace obuild */
+
+#endif
@@ -0,0 +1,73 @@
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <thread>
+
+#include <ostd/platform.hh>
+
+#include "throttle.hh"
+#include "state.hh"
+
+namespace obuild {
+
+/* how often the host is looked at, also the sleep between checks */
+static constexpr std::int64_t SAMPLE_MS = 100;
+
+load_throttle::load_throttle(double max_load, double max_pressure):
+    p_max_load{max_load}, p_max_pressure{max_pressure}
+{}
+
+#ifdef OSTD_PLATFORM_LINUX
+/* the share of the last 10 seconds some tasks were stalled on the
+ * resource, in percent; -1 without PSI (old kernels, some containers)
+ */
+static double read_pressure(char const *path) {
+    std::FILE *f = std::fopen(path, "rb");
+    if (!f) {
+        return -1;
+    }
+    double ret = -1;
+    if (std::fscanf(f, "some avg10=%lf", &ret) != 1) {
+        ret = -1;
+    }
+    std::fclose(f);
+    return ret;
+}
+#endif
+
+bool load_throttle::saturated() {
+    std::lock_guard<std::mutex> l{p_lock};
+    auto now = time_ms();
+    if ((now - p_sampled) < SAMPLE_MS) {
+        return p_saturated;
+    }
+    p_sampled = now;
+    p_saturated = false;
+    double load;
+    if ((p_max_load > 0) && (getloadavg(&load, 1) == 1)) {
+        p_saturated = (load >= p_max_load);
+    }
+#ifdef OSTD_PLATFORM_LINUX
+    if (!p_saturated && (p_max_pressure > 0)) {
+        p_saturated = (
+            read_pressure("/proc/pressure/cpu") >= p_max_pressure
+        ) || (
+            read_pressure("/proc/pressure/memory") >= p_max_pressure
+        );
+    }
+#endif
+    return p_saturated;
+}
+
+void load_throttle::start() {
+    while (p_running && saturated()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(SAMPLE_MS));
+    }
+    ++p_running;
+}
+
+void load_throttle::finish() {
+    --p_running;
+}
+
+} /* namespace obuild */
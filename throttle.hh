@@ -0,0 +1,36 @@
+#ifndef OBUILD_THROTTLE_HH
+#define OBUILD_THROTTLE_HH
+
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+
+namespace obuild {
+
+/* holds back new commands while the host is saturated, judged by the load
+ * average and, on Linux, by pressure stall information; a command is
+ * always allowed to start when none of ours are running, so that the
+ * build keeps making progress
+ */
+struct load_throttle {
+    /* a limit of 0 disables the respective check */
+    load_throttle(double max_load, double max_pressure);
+
+    /* thread safe, blocks until a command may start */
+    void start();
+    void finish();
+
+private:
+    bool saturated();
+
+    double p_max_load;
+    double p_max_pressure;
+    std::atomic<int> p_running{0};
+    std::mutex p_lock;
+    std::int64_t p_sampled = 0;
+    bool p_saturated = false;
+};
+
+} /* namespace obuild */
+
+#endif
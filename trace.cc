@@ -0,0 +1,147 @@
+#include <cstdio>
+
+#include "trace.hh"
+
+namespace obuild {
+
+build_trace::build_trace(std::string path):
+    p_path{std::move(path)}, p_start{std::chrono::steady_clock::now()}
+{
+    /* whoever creates the trace is the main thread */
+    p_slots.emplace(std::this_thread::get_id(), 0);
+}
+
+std::int64_t build_trace::now() const {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - p_start
+    ).count();
+}
+
+/* with the lock held */
+int build_trace::slot() {
+    auto id = std::this_thread::get_id();
+    auto it = p_slots.find(id);
+    if (it == p_slots.end()) {
+        it = p_slots.emplace(id, int(p_slots.size())).first;
+    }
+    return it->second;
+}
+
+void build_trace::add(
+    std::string_view cat, std::string_view name, std::int64_t start,
+    std::string_view target, int status
+) {
+    auto end = now();
+    std::lock_guard<std::mutex> l{p_lock};
+    p_events.push_back(event{
+        std::string{cat}, std::string{name}, std::string{target},
+        start, end, slot(), status, false
+    });
+}
+
+void build_trace::add_async(
+    std::string_view cat, std::string_view name, std::int64_t start,
+    std::string_view target, int status
+) {
+    auto end = now();
+    std::lock_guard<std::mutex> l{p_lock};
+    p_events.push_back(event{
+        std::string{cat}, std::string{name}, std::string{target},
+        start, end, slot(), status, true
+    });
+}
+
+static void write_str(std::string &buf, std::string_view s) {
+    buf += '"';
+    for (char c: s) {
+        switch (c) {
+            case '"':  buf += "\\\""; break;
+            case '\\': buf += "\\\\"; break;
+            case '\n': buf += "\\n"; break;
+            case '\t': buf += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char ebuf[8];
+                    std::snprintf(ebuf, sizeof(ebuf), "\\u%04x", c);
+                    buf += ebuf;
+                } else {
+                    buf += c;
+                }
+                break;
+        }
+    }
+    buf += '"';
+}
+
+build_trace::~build_trace() {
+    write();
+}
+
+void build_trace::write() {
+    std::lock_guard<std::mutex> l{p_lock};
+    std::string buf = "{\"traceEvents\":[\n";
+    char nbuf[128];
+    bool first = true;
+    /* name the slots in the viewer */
+    for (auto &p: p_slots) {
+        std::snprintf(
+            nbuf, sizeof(nbuf), "%s{\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+            "\"name\":\"thread_name\",\"args\":{\"name\":", first ? "" : ",\n",
+            p.second
+        );
+        buf += nbuf;
+        write_str(buf, p.second ? (
+            "worker " + std::to_string(p.second)
+        ) : std::string{"main"});
+        buf += "}}";
+        first = false;
+    }
+    auto head = [&buf, &first](event const &ev) {
+        buf += first ? "{\"name\":" : ",\n{\"name\":";
+        first = false;
+        write_str(buf, ev.name);
+        buf += ",\"cat\":";
+        write_str(buf, ev.cat);
+    };
+    for (std::size_t i = 0; i < p_events.size(); ++i) {
+        auto &ev = p_events[i];
+        head(ev);
+        if (ev.async) {
+            /* a begin and an end matched by the id */
+            std::snprintf(
+                nbuf, sizeof(nbuf), ",\"ph\":\"b\",\"id\":\"0x%zx\","
+                "\"ts\":%lld,\"pid\":1,\"tid\":%d,\"args\":{\"target\":",
+                i, static_cast<long long>(ev.start), ev.slot
+            );
+        } else {
+            std::snprintf(
+                nbuf, sizeof(nbuf), ",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,"
+                "\"pid\":1,\"tid\":%d,\"args\":{\"target\":",
+                static_cast<long long>(ev.start),
+                static_cast<long long>(ev.end - ev.start), ev.slot
+            );
+        }
+        buf += nbuf;
+        write_str(buf, ev.target);
+        std::snprintf(nbuf, sizeof(nbuf), ",\"status\":%d}}", ev.status);
+        buf += nbuf;
+        if (ev.async) {
+            head(ev);
+            std::snprintf(
+                nbuf, sizeof(nbuf), ",\"ph\":\"e\",\"id\":\"0x%zx\","
+                "\"ts\":%lld,\"pid\":1,\"tid\":%d}",
+                i, static_cast<long long>(ev.end), ev.slot
+            );
+            buf += nbuf;
+        }
+    }
+    buf += "\n]}\n";
+    std::FILE *f = std::fopen(p_path.data(), "wb");
+    if (!f) {
+        return;
+    }
+    std::fwrite(buf.data(), 1, buf.size(), f);
+    std::fclose(f);
+}
+
+} /* namespace obuild */
@@ -0,0 +1,73 @@
+#ifndef OBUILD_TRACE_HH
+#define OBUILD_TRACE_HH
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <unordered_map>
+
+namespace obuild {
+
+/* a timeline of the build in the Chrome trace event format, viewable in
+ * chrome://tracing or Perfetto; events are kept in memory and written
+ * out when the trace is destroyed, so that failed builds get one too,
+ * or whenever a process that never exits finished another build
+ */
+struct build_trace {
+    build_trace(std::string path);
+    build_trace(build_trace const &) = delete;
+    ~build_trace();
+
+    build_trace &operator=(build_trace const &) = delete;
+
+    /* microseconds since the trace was started */
+    std::int64_t now() const;
+
+    /* thread safe; an event from start until now on the calling thread,
+     * whose slot is 0 for the main thread and 1.. for the workers
+     */
+    void add(
+        std::string_view cat, std::string_view name, std::int64_t start,
+        std::string_view target = std::string_view{}, int status = 0
+    );
+
+    /* like add, for spans that interleave with others on the same thread
+     * without nesting, like rule bodies, which yield while their commands
+     * run; they get a track of their own in the viewer
+     */
+    void add_async(
+        std::string_view cat, std::string_view name, std::int64_t start,
+        std::string_view target = std::string_view{}, int status = 0
+    );
+
+    /* thread safe; replaces the file with all events so far */
+    void write();
+
+private:
+    struct event {
+        std::string cat;
+        std::string name;
+        std::string target;
+        std::int64_t start;
+        std::int64_t end;
+        int slot;
+        int status;
+        bool async;
+    };
+
+    int slot();
+
+    std::string p_path;
+    std::chrono::steady_clock::time_point p_start;
+    std::mutex p_lock;
+    std::vector<event> p_events;
+    std::unordered_map<std::thread::id, int> p_slots;
+};
+
+} /* namespace obuild */
+
+#endif
@@ -0,0 +1,264 @@
+#include <cerrno>
+#include <cstdint>
+#include <string_view>
+#include <algorithm>
+
+#include <ostd/platform.hh>
+
+#include <poll.h>
+#include <unistd.h>
+#ifdef OSTD_PLATFORM_LINUX
+#include <sys/inotify.h>
+#endif
+
+#include "watch.hh"
+
+namespace obuild {
+
+#ifdef OSTD_PLATFORM_LINUX
+
+/* everything an editor or a checkout may do to a file, and to the
+ * directory itself
+ */
+static constexpr std::uint32_t WATCH_EVENTS =
+    IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE |
+    IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF;
+
+/* the watch is gone, or no longer on the directory at its path */
+static constexpr std::uint32_t WATCH_LOST =
+    IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED;
+
+file_watcher::~file_watcher() {
+    if (p_fd >= 0) {
+        close(p_fd);
+    }
+}
+
+bool file_watcher::open() {
+    p_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    return p_fd >= 0;
+}
+
+/* paths in the current directory have no directory part */
+static std::string normalize(std::string_view path) {
+    while (path.substr(0, 2) == "./") {
+        path.remove_prefix(2);
+    }
+    if (path == ".") {
+        return std::string{};
+    }
+    while ((path.size() > 1) && (path.back() == '/')) {
+        path.remove_suffix(1);
+    }
+    return std::string{path};
+}
+
+/* of a normalized path */
+static std::string parent_dir(std::string const &np) {
+    auto slash = np.rfind('/');
+    return (slash == np.npos) ? std::string{} : np.substr(0, slash ? slash : 1);
+}
+
+static int add_watch(int fd, std::string const &dir) {
+    return inotify_add_watch(fd, dir.empty() ? "." : dir.data(), WATCH_EVENTS);
+}
+
+/* directories that were not there are tried again */
+int file_watcher::watch_dir(std::string const &dir) {
+    auto it = p_wds.find(dir);
+    if ((it != p_wds.end()) && (it->second >= 0)) {
+        return it->second;
+    }
+    int wd = add_watch(p_fd, dir);
+    if (wd >= 0) {
+        p_dirs[wd] = dir;
+    }
+    p_wds[dir] = wd;
+    return wd;
+}
+
+void file_watcher::rewatch(
+    bool all, std::unordered_set<std::string> &changed
+) {
+    for (auto &p: p_wds) {
+        if (!all && (p.second >= 0)) {
+            continue;
+        }
+        /* the same one if the directory is still the one watched */
+        int wd = add_watch(p_fd, p.first);
+        if (wd == p.second) {
+            continue;
+        }
+        if (p.second >= 0) {
+            p_dirs.erase(p.second);
+        }
+        if (wd >= 0) {
+            p_dirs[wd] = p.first;
+            /* not the directory it was, so its entries may differ */
+            changed_in(p.first, changed);
+        }
+        p.second = wd;
+    }
+}
+
+void file_watcher::changed_in(
+    std::string const &dir, std::unordered_set<std::string> &changed
+) {
+    auto wit = p_whole.find(dir);
+    if (wit != p_whole.end()) {
+        changed.insert(wit->second.begin(), wit->second.end());
+    }
+    for (auto &p: p_files) {
+        if (parent_dir(p.first) == dir) {
+            changed.insert(p.second.begin(), p.second.end());
+        }
+    }
+}
+
+void file_watcher::changed_all(std::unordered_set<std::string> &changed) {
+    for (auto *ways: {&p_files, &p_whole}) {
+        for (auto &p: *ways) {
+            changed.insert(p.second.begin(), p.second.end());
+        }
+    }
+}
+
+static void add_way(std::vector<std::string> &ways, std::string const &path) {
+    if (std::find(ways.begin(), ways.end(), path) == ways.end()) {
+        ways.push_back(path);
+    }
+}
+
+void file_watcher::add(std::string const &path, bool whole) {
+    auto np = normalize(path);
+    if (whole) {
+        watch_dir(np);
+        add_way(p_whole[np], path);
+        return;
+    }
+    watch_dir(parent_dir(np));
+    add_way(p_files[np], path);
+}
+
+bool file_watcher::read_events(std::unordered_set<std::string> &changed) {
+    alignas(inotify_event) char buf[16384];
+    for (;;) {
+        auto n = read(p_fd, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                return false;
+            }
+            if (p_overflow || p_lost) {
+                rewatch(p_overflow, changed);
+                p_overflow = p_lost = false;
+            }
+            return true;
+        }
+        for (char *p = buf; p < (buf + n);) {
+            auto *ev = reinterpret_cast<inotify_event *>(p);
+            p += sizeof(inotify_event) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                /* events were dropped, so anything may have changed */
+                changed_all(changed);
+                p_overflow = true;
+                continue;
+            }
+            auto it = p_dirs.find(ev->wd);
+            if (it == p_dirs.end()) {
+                continue;
+            }
+            auto &dir = it->second;
+            if (ev->mask & WATCH_LOST) {
+                /* e.g. removed by a checkout, maybe to be created again */
+                changed_in(dir, changed);
+                if (!(ev->mask & IN_IGNORED)) {
+                    inotify_rm_watch(p_fd, ev->wd);
+                }
+                p_wds[dir] = -1;
+                p_dirs.erase(it);
+                p_lost = true;
+                continue;
+            }
+            auto wit = p_whole.find(dir);
+            if ((wit != p_whole.end()) && (ev->mask & (
+                IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM
+            ))) {
+                changed.insert(wit->second.begin(), wit->second.end());
+            }
+            if (!ev->len) {
+                continue;
+            }
+            std::string path = dir;
+            if (!path.empty() && (path != "/")) {
+                path += '/';
+            }
+            path += ev->name;
+            auto fit = p_files.find(path);
+            if (fit != p_files.end()) {
+                changed.insert(fit->second.begin(), fit->second.end());
+            }
+        }
+    }
+}
+
+bool file_watcher::wait(std::vector<std::string> &changed, int debounce_ms) {
+    std::unordered_set<std::string> found;
+    pollfd pfd{p_fd, POLLIN, 0};
+    while (found.empty()) {
+        if ((poll(&pfd, 1, -1) < 0) && (errno != EINTR)) {
+            return false;
+        }
+        if (!read_events(found)) {
+            return false;
+        }
+    }
+    /* saving a file or switching branches is a burst of events */
+    for (;;) {
+        int ret = poll(&pfd, 1, debounce_ms);
+        if (!ret) {
+            break;
+        }
+        if (((ret < 0) && (errno != EINTR)) || !read_events(found)) {
+            return false;
+        }
+    }
+    changed.assign(found.begin(), found.end());
+    return true;
+}
+
+bool file_watcher::take(std::vector<std::string> &changed) {
+    std::unordered_set<std::string> found;
+    if (!read_events(found)) {
+        return false;
+    }
+    changed.insert(changed.end(), found.begin(), found.end());
+    return true;
+}
+
+#else
+
+/* without inotify there is nothing to watch with; -w and -s are refused
+ * before a watcher is ever needed
+ */
+file_watcher::~file_watcher() {}
+
+bool file_watcher::open() {
+    return false;
+}
+
+void file_watcher::add(std::string const &, bool) {}
+
+bool file_watcher::wait(std::vector<std::string> &, int) {
+    return false;
+}
+
+bool file_watcher::take(std::vector<std::string> &) {
+    return false;
+}
+
+#endif
+
+} /* namespace obuild */
@@ -0,0 +1,70 @@
+#ifndef OBUILD_WATCH_HH
+#define OBUILD_WATCH_HH
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace obuild {
+
+/* waits for changes of files through inotify; the directories containing
+ * them are watched, so that editors replacing files by renaming them
+ * are caught as well; Linux only, open fails elsewhere
+ */
+struct file_watcher {
+    file_watcher() {}
+    file_watcher(file_watcher const &) = delete;
+    ~file_watcher();
+
+    file_watcher &operator=(file_watcher const &) = delete;
+
+    /* false if inotify is not available */
+    bool open();
+
+    /* with whole set, a change of any entry of the directory counts;
+     * adding a path again does nothing
+     */
+    void add(std::string const &path, bool whole = false);
+
+    /* blocks until some of the paths changed and then until nothing
+     * changed for the debounce interval; paths are reported the way
+     * they were added, whole directories as themselves
+     */
+    bool wait(std::vector<std::string> &changed, int debounce_ms);
+
+    /* adds whatever changed so far without blocking */
+    bool take(std::vector<std::string> &changed);
+
+    /* readable when something happened, for polling along other things */
+    int fd() const {
+        return p_fd;
+    }
+
+private:
+    bool read_events(std::unordered_set<std::string> &changed);
+    int watch_dir(std::string const &dir);
+    /* with all set, also directories that are still watched, as they may
+     * have been replaced by others while events were being dropped
+     */
+    void rewatch(bool all, std::unordered_set<std::string> &changed);
+    void changed_in(
+        std::string const &dir, std::unordered_set<std::string> &changed
+    );
+    void changed_all(std::unordered_set<std::string> &changed);
+
+    int p_fd = -1;
+    /* directories are watched again once the events are read */
+    bool p_overflow = false;
+    bool p_lost = false;
+    std::unordered_map<int, std::string> p_dirs;
+    /* -1 for directories that are not there */
+    std::unordered_map<std::string, int> p_wds;
+    /* by normalized path, with the ways they were added */
+    std::unordered_map<std::string, std::vector<std::string>> p_files;
+    std::unordered_map<std::string, std::vector<std::string>> p_whole;
+};
+
+} /* namespace obuild */
+
+#endif